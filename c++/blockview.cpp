@@ -0,0 +1,153 @@
+#include "blockview.h"
+
+#include <string.h>
+#include <assert.h>
+
+BlockView::BlockView(const std::vector<unsigned char>& blockIn) : block(blockIn), hash(32), checksum_known(false) {
+	assert(block.size() >= sizeof(struct bitcoin_msg_header) + 80);
+	getblockhash(hash, block, sizeof(struct bitcoin_msg_header));
+	parse();
+}
+
+BlockView::BlockView(const std::vector<unsigned char>& blockIn, const std::vector<unsigned char>& hashIn) : block(blockIn), hash(hashIn), checksum_known(false) {
+	assert(block.size() >= sizeof(struct bitcoin_msg_header) + 80 && hash.size() == 32);
+	parse();
+}
+
+BlockView::BlockView(const std::vector<unsigned char>& blockIn, const std::vector<unsigned char>& hashIn, bool msg_header_ready) :
+		block(blockIn), hash(hashIn), checksum_known(msg_header_ready) {
+	assert(block.size() >= sizeof(struct bitcoin_msg_header) + 80 && hash.size() == 32);
+	if (checksum_known)
+		memcpy(checksum, ((const struct bitcoin_msg_header*)&block[0])->checksum, sizeof(checksum));
+	parse();
+}
+
+BlockView::BlockView(const std::shared_ptr<std::vector<unsigned char> >& blockIn) : BlockView(*blockIn) {
+	shared_block = blockIn;
+}
+
+BlockView::BlockView(const std::shared_ptr<std::vector<unsigned char> >& blockIn, const std::vector<unsigned char>& hashIn, bool msg_header_ready) :
+		BlockView(*blockIn, hashIn, msg_header_ready) {
+	shared_block = blockIn;
+}
+
+// Moves it over one transaction, throwing read_exception if it doesn't fit before end
+static void skip_tx(std::vector<unsigned char>::const_iterator& it, const std::vector<unsigned char>::const_iterator& end) {
+	move_forward(it, 4, end);
+
+	uint64_t txins = read_varint(it, end);
+	for (uint64_t j = 0; j < txins; j++) {
+		move_forward(it, 36, end);
+		move_forward(it, read_varint(it, end) + 4, end);
+	}
+
+	uint64_t txouts = read_varint(it, end);
+	for (uint64_t j = 0; j < txouts; j++) {
+		move_forward(it, 8, end);
+		move_forward(it, read_varint(it, end), end);
+	}
+
+	move_forward(it, 4, end);
+}
+
+void BlockView::parse() {
+	const unsigned char* v = header();
+	block_version = ((v[3] << 24) | (v[2] << 16) | (v[1] << 8) | v[0]);
+	parse_error = NULL;
+
+	try {
+		std::vector<unsigned char>::const_iterator readit = block.begin() + sizeof(struct bitcoin_msg_header) + 80;
+
+		uint64_t txcount = read_varint(readit, block.end());
+		if (txcount < 1 || txcount > 100000) {
+			parse_error = "TXCOUNT_RANGE";
+			return;
+		}
+		txn.reserve(txcount);
+
+		for (uint32_t i = 0; i < txcount; i++) {
+			std::vector<unsigned char>::const_iterator txstart = readit;
+			skip_tx(readit, block.end());
+			txn.push_back(TxRef { uint32_t(txstart - block.begin()), uint32_t(readit - txstart) });
+		}
+	} catch(read_exception) {
+		parse_error = "INVALID_SIZE";
+	}
+}
+
+const unsigned char* BlockView::txid(uint32_t i) const {
+	assert(!parse_error && i < txn.size());
+	std::call_once(txids_once, [&]() {
+		txids.resize(txn.size() * 32);
+		for (uint32_t j = 0; j < txn.size(); j++)
+			double_sha256(&block[txn[j].offset], &txids[j * 32], txn[j].length);
+	});
+	return &txids[i * 32];
+}
+
+const unsigned char* BlockView::msg_checksum() const {
+	if (checksum_known)
+		return checksum;
+	std::call_once(checksum_once, [&]() {
+		unsigned char fullhash[32];
+		double_sha256(&block[sizeof(struct bitcoin_msg_header)], fullhash, block.size() - sizeof(struct bitcoin_msg_header));
+		memcpy(checksum, fullhash, sizeof(checksum));
+	});
+	return checksum;
+}
+
+std::shared_ptr<std::vector<unsigned char> > BlockView::msg_bytes() const {
+	if (!shared_block)
+		return shared_block;
+	// checksum_known is only set by views whose header is already filled in
+	if (!checksum_known)
+		std::call_once(msg_header_once, [&]() {
+			prepare_message("block", &(*shared_block)[0], shared_block->size() - sizeof(struct bitcoin_msg_header), msg_checksum());
+		});
+	return shared_block;
+}
+
+BlockStreamParser::BlockStreamParser(const std::vector<unsigned char>& blockIn) :
+	block(blockIn), parsed(sizeof(struct bitcoin_msg_header) + 80), txcount(0), txn_found(0), parse_error(NULL) {}
+
+bool BlockStreamParser::read_header(size_t available) {
+	if (txcount || parse_error)
+		return txcount != 0;
+	assert(available <= block.size());
+
+	try {
+		std::vector<unsigned char>::const_iterator readit = block.begin() + parsed;
+		uint64_t count = read_varint(readit, block.begin() + available);
+		if (count < 1 || count > 100000)
+			parse_error = "TXCOUNT_RANGE";
+		else {
+			txcount = count;
+			parsed = readit - block.begin();
+		}
+	} catch(read_exception) {
+		if (available == block.size())
+			parse_error = "INVALID_SIZE";
+	}
+	return txcount != 0;
+}
+
+bool BlockStreamParser::next_tx(size_t available, BlockView::TxRef& tx) {
+	if (!txcount || done() || parse_error)
+		return false;
+	assert(available <= block.size());
+
+	try {
+		std::vector<unsigned char>::const_iterator readit = block.begin() + parsed;
+		skip_tx(readit, block.begin() + available);
+
+		tx.offset = parsed;
+		tx.length = (readit - block.begin()) - parsed;
+		parsed += tx.length;
+		txn_found++;
+		return true;
+	} catch(read_exception) {
+		if (available == block.size())
+			parse_error = "INVALID_SIZE";
+		return false;
+	}
+}
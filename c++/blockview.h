@@ -0,0 +1,100 @@
+#ifndef _RELAY_BLOCKVIEW_H
+#define _RELAY_BLOCKVIEW_H
+
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <stdint.h>
+
+#include "utils.h"
+
+/***************************
+ **** Parsed block view ****
+ ***************************/
+// A block (prefixed with space for a bitcoin_msg_header, as everything else passes them around)
+// which is hashed and split into transactions exactly once and then handed to every compressor,
+// P2PRelayer and log line which needs to look at it.
+// The view does not own the bytes, they must outlive it and must not change while it exists (bar
+// the bitcoin_msg_header space, which a view of a shared buffer fills in for msg_bytes()).
+class BlockView {
+public:
+	struct TxRef {
+		uint32_t offset, length;
+	};
+
+private:
+	const std::vector<unsigned char>& block;
+	std::shared_ptr<std::vector<unsigned char> > shared_block;
+	std::vector<unsigned char> hash;
+	int32_t block_version;
+	std::vector<TxRef> txn;
+	const char* parse_error;
+
+	mutable std::once_flag txids_once, checksum_once, msg_header_once;
+	mutable std::vector<unsigned char> txids;
+	mutable unsigned char checksum[4];
+	bool checksum_known;
+
+	void parse();
+
+public:
+	// block must be at least sizeof(bitcoin_msg_header) + 80 bytes
+	BlockView(const std::vector<unsigned char>& blockIn);
+	BlockView(const std::vector<unsigned char>& blockIn, const std::vector<unsigned char>& hashIn);
+	// For blocks whose bitcoin_msg_header has already been filled in (eg by decompress_relay_block)
+	BlockView(const std::vector<unsigned char>& blockIn, const std::vector<unsigned char>& hashIn, bool msg_header_ready);
+	// Views of a shared buffer, which msg_bytes() can hand out to be sent as-is
+	BlockView(const std::shared_ptr<std::vector<unsigned char> >& blockIn);
+	BlockView(const std::shared_ptr<std::vector<unsigned char> >& blockIn, const std::vector<unsigned char>& hashIn, bool msg_header_ready);
+
+	BlockView(const BlockView&) = delete;
+	BlockView& operator=(const BlockView&) = delete;
+
+	const std::vector<unsigned char>& bytes() const { return block; }
+	const std::vector<unsigned char>& get_hash() const { return hash; }
+	const unsigned char* header() const { return &block[sizeof(struct bitcoin_msg_header)]; }
+	const unsigned char* merkle_root() const { return header() + 4 + 32; }
+	int32_t version() const { return block_version; }
+
+	// NULL if the transaction list was parsed successfully, otherwise a short error string
+	// matching those returned by RelayNodeCompressor::maybe_compress_block
+	const char* error() const { return parse_error; }
+
+	uint32_t tx_count() const { return txn.size(); }
+	const TxRef& tx(uint32_t i) const { return txn[i]; }
+	std::vector<unsigned char>::const_iterator tx_begin(uint32_t i) const { return block.begin() + txn[i].offset; }
+	std::vector<unsigned char>::const_iterator tx_end(uint32_t i) const { return block.begin() + txn[i].offset + txn[i].length; }
+
+	// Calculated on first use (thread-safe)
+	const unsigned char* txid(uint32_t i) const;
+	const unsigned char* msg_checksum() const;
+	// The shared buffer, with its bitcoin_msg_header filled in (on first use, thread-safe), ready to
+	// be queued for sending as a block message. NULL for views of an unshared buffer.
+	std::shared_ptr<std::vector<unsigned char> > msg_bytes() const;
+};
+
+// Splits a block into transactions while it is still being read off the wire, for cut-through relay.
+// The buffer (with space for a bitcoin_msg_header in front) must already be sized for the whole
+// block, and only its first available bytes are ever looked at.
+class BlockStreamParser {
+private:
+	const std::vector<unsigned char>& block;
+	size_t parsed;
+	uint32_t txcount, txn_found;
+	const char* parse_error;
+
+public:
+	BlockStreamParser(const std::vector<unsigned char>& blockIn);
+
+	// Returns true once the header and transaction count have arrived
+	bool read_header(size_t available);
+	// Returns true and fills in tx if another complete transaction is within the first available bytes
+	bool next_tx(size_t available, BlockView::TxRef& tx);
+
+	uint32_t tx_count() const { return txcount; }
+	bool done() const { return txcount && txn_found == txcount; }
+	// Same strings as BlockView::error()
+	const char* error() const { return parse_error; }
+};
+
+#endif
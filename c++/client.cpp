@@ -25,6 +25,7 @@
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
 #include "relayprocess.h"
+#include "blockview.h"
 #include "utils.h"
 #include "p2pclient.h"
 
@@ -39,7 +40,8 @@ class RelayNetworkClient : public KeepaliveOutboundPersistentConnection {
 private:
 	RELAY_DECLARE_CLASS_VARS
 
-	const std::function<void (std::vector<unsigned char>&)> provide_block;
+	const std::function<void (const BlockView&)> provide_block;
+	const std::function<void (const unsigned char*)> provide_header;
 	const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
 	const std::function<bool ()> bitcoind_connected;
 
@@ -47,14 +49,20 @@ private:
 
 	RelayNodeCompressor compressor;
 
+	// Our place in the server's relay session, kept across reconnects so that the server only has to
+	// send what we missed. session_seq counts every TRANSACTION and BLOCK we have applied since.
+	uint64_t session_id, session_seq;
+
 public:
 	RelayNetworkClient(const char* serverHostIn,
-						const std::function<void (std::vector<unsigned char>&)>& provide_block_in,
+						const std::function<void (const BlockView&)>& provide_block_in,
+						const std::function<void (const unsigned char*)>& provide_header_in,
 						const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
 						const std::function<bool ()>& bitcoind_connected_in)
 		// Ping time(out) is 40 seconds (5000000/250*2 msec) - first ping will only happen, at the quickest, at half that
 			: KeepaliveOutboundPersistentConnection(serverHostIn, 8336, MAX_FAS_TOTAL_SIZE / OUTBOUND_THROTTLE_BYTES_PER_MS * 2), RELAY_DECLARE_CONSTRUCTOR_EXTENDS,
-			provide_block(provide_block_in), provide_transaction(provide_transaction_in), bitcoind_connected(bitcoind_connected_in), connected(false), compressor(false) {
+			provide_block(provide_block_in), provide_header(provide_header_in), provide_transaction(provide_transaction_in), bitcoind_connected(bitcoind_connected_in), connected(false), compressor(false, true, true),
+			session_id(0), session_seq(0) {
 		construction_done();
 	}
 
@@ -64,11 +72,15 @@ private:
 	}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
-		compressor.reset();
+		// The server's cache of what we sent it is new, but ours of what it sent us may be resumable
+		compressor.reset_send();
+		if (!session_id)
+			compressor.reset_recv();
 
 		relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(strlen(VERSION_STRING)) };
 		maybe_do_send_bytes((char*)&version_header, sizeof(version_header));
 		maybe_do_send_bytes(VERSION_STRING, strlen(VERSION_STRING));
+		maybe_do_send_bytes(compressor.session_to_msg(session_id, session_seq, session_id != 0));
 
 		connected = true;
 
@@ -114,14 +126,37 @@ private:
 			} else if (header.type == BLOCK_TYPE) {
 				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) { return this->read_all(buf, count); };
 				auto res = compressor.decompress_relay_block(do_read, message_size, false);
-				if (std::get<2>(res))
+				if (std::get<2>(res) && !strcmp(std::get<2>(res), "ABORTED")) {
+					session_seq++;
+					STAMPOUT();
+					printf(HASH_FORMAT" aborted by relay server\n", HASH_PRINT(&(*std::get<3>(res))[0]));
+					continue;
+				} else if (std::get<2>(res)) {
+					// We can't be sure our cache still matches the server's
+					session_id = 0;
 					return disconnect(std::get<2>(res));
-
-				provide_block(*std::get<1>(res));
+				}
+				session_seq++;
 
 				auto fullhash = *std::get<3>(res).get();
+				BlockView block(std::get<1>(res), fullhash, true);
+				provide_block(block);
+
 				STAMPOUT();
 				printf(HASH_FORMAT" recv'd, size %lu with %u bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)std::get<1>(res)->size() - sizeof(bitcoin_msg_header), std::get<0>(res));
+			} else if (header.type == BLOCK_HEADER_TYPE) {
+				std::vector<unsigned char> block_header(80), fullhash(32);
+				if (message_size != 80 || read_all((char*)&block_header[0], 80) < 80)
+					return disconnect("failed to read 80 byte block header");
+
+				getblockhash(fullhash, block_header, 0);
+				if (!check_header_work(&block_header[0], fullhash))
+					return disconnect("got block header which did not meet its target");
+
+				provide_header(&block_header[0]);
+
+				STAMPOUT();
+				printf(HASH_FORMAT" header recv'd\n", HASH_PRINT(&fullhash[0]));
 			} else if (header.type == END_BLOCK_TYPE) {
 			} else if (header.type == TRANSACTION_TYPE) {
 				if (!compressor.maybe_recv_tx_of_size(message_size, true))
@@ -137,7 +172,69 @@ private:
 					printf("ERROR: bitcoind is not (yet) connected!\n");
 
 				compressor.recv_tx(tx);
+				session_seq++;
+				provide_transaction(tx);
+			} else if (header.type == RECENT_TRANSACTION_TYPE) {
+				if (message_size > MAX_RELAY_TRANSACTION_BYTES)
+					return disconnect("got recent transaction too large");
+
+				auto tx = std::make_shared<std::vector<unsigned char> > (message_size);
+				if (read_all((char*)&(*tx)[0], message_size) < (int64_t)(message_size))
+					return disconnect("failed to read recent transaction data");
+
+				compressor.recv_recent_tx(tx);
+				session_seq++;
+			} else if (header.type == RESTORE_TYPE) {
+				std::vector<unsigned char> data(message_size);
+				if (read_all((char*)data.data(), message_size) < (int64_t)(message_size))
+					return disconnect("failed to read restore message");
+
+				std::shared_ptr<std::vector<unsigned char> > tx;
+				const char* err = compressor.recv_restore(data, tx);
+				if (err) {
+					// We can't be sure our cache still matches the server's
+					session_id = 0;
+					return disconnect(err);
+				}
+				session_seq++;
+
+				printf("Restored transaction of size %lu from relay server\n", (unsigned long)tx->size());
 				provide_transaction(tx);
+			} else if (header.type == EVICT_TYPE) {
+				std::vector<unsigned char> indexes(message_size);
+				if (read_all((char*)indexes.data(), message_size) < (int64_t)(message_size))
+					return disconnect("failed to read evict message");
+
+				const char* err = compressor.recv_evict(indexes);
+				if (err) {
+					// We can't be sure our cache still matches the server's
+					session_id = 0;
+					return disconnect(err);
+				}
+				session_seq++;
+			} else if (header.type == SESSION_TYPE) {
+				unsigned char data[17];
+				if (message_size != 17 || read_all((char*)data, 17) < 17)
+					return disconnect("failed to read session message");
+
+				uint64_t their_session_id = 0, their_seq = 0;
+				for (int i = 0; i < 8; i++) {
+					their_session_id = (their_session_id << 8) | data[i];
+					their_seq = (their_seq << 8) | data[8 + i];
+				}
+
+				if (!data[16]) {
+					// The server couldn't resume, the whole of its cache follows
+					compressor.reset_recv();
+					session_id = 0;
+				} else {
+					if (session_id && their_session_id == session_id && their_seq == session_seq) {
+						STAMPOUT();
+						printf("Resumed relay session\n");
+					}
+					session_id = their_session_id;
+					session_seq = their_seq;
+				}
 			} else if (header.type == PING_TYPE) {
 				char data[8 + sizeof(relay_msg_header)];
 				if (message_size != 8 || read_all(&data[sizeof(relay_msg_header)], 8) < 8)
@@ -186,14 +283,11 @@ public:
 			printf("Sent transaction of size %lu%s to relay server\n", (unsigned long)tx->size(), send_oob ? " (out-of-band)" : "");
 	}
 
-	void receive_block(const std::vector<unsigned char>& block) {
+	void receive_block(const BlockView& block) {
 		if (!connected)
 			return;
 
-		std::vector<unsigned char> fullhash(32);
-		getblockhash(fullhash, block, sizeof(struct bitcoin_msg_header));
-
-		auto tuple = compressor.maybe_compress_block(fullhash, block, false);
+		auto tuple = compressor.maybe_compress_block(block, false);
 		if (std::get<1>(tuple)) {
 			printf("Failed to process block from bitcoind (%s)\n", std::get<1>(tuple));
 			return;
@@ -206,14 +300,14 @@ public:
 		maybe_do_send_bytes((char*)&(*compressed_block)[0], compressed_block->size());
 
 		STAMPOUT();
-		printf(HASH_FORMAT" sent, size %lu with %lu bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)block.size(), (unsigned long)compressed_block->size());
+		printf(HASH_FORMAT" sent, size %lu with %lu bytes on the wire\n", HASH_PRINT(&block.get_hash()[0]), (unsigned long)block.bytes().size(), (unsigned long)compressed_block->size());
 	}
 };
 
 class P2PClient : public P2PRelayer {
 public:
 	P2PClient(const char* serverHostIn, uint16_t serverPortIn,
-				const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)>& provide_block_in,
+				const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const std::chrono::system_clock::time_point&)>& provide_block_in,
 				const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in) :
 			P2PRelayer(serverHostIn, serverPortIn, 10000, provide_block_in, provide_transaction_in)
 		{ construction_done(); }
@@ -316,12 +410,18 @@ int main(int argc, char** argv) {
 
 	RelayNetworkClient* relayClient;
 	P2PClient p2p(argv[1], std::stoul(argv[2]),
-					[&](std::vector<unsigned char>& bytes, const std::chrono::system_clock::time_point&) { relayClient->receive_block(bytes); },
+					[&](const std::shared_ptr<std::vector<unsigned char> >& bytes, const std::chrono::system_clock::time_point&) {
+						if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
+							return;
+						BlockView block(bytes);
+						relayClient->receive_block(block);
+					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 						//TODO: Re-enable (see issue #11): relayClient->receive_transaction(bytes, true);
 					});
 	relayClient = new RelayNetworkClient(host,
-										[&](std::vector<unsigned char>& bytes) { p2p.receive_block(bytes); },
+										[&](const BlockView& block) { p2p.receive_block(block); },
+										[&](const unsigned char* header) { p2p.receive_header(header); },
 										[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 											p2p.receive_transaction(bytes);
 											relayClient->receive_transaction(bytes, false);
@@ -0,0 +1,17 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SIPHASH_H
+#define BITCOIN_SIPHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** SipHash-2-4 of a 32-byte value (ie a txid), keyed with k0/k1. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const unsigned char* val);
+
+/** SipHash-2-4 of size bytes of data, keyed with k0/k1. */
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char* data, size_t size);
+
+#endif
@@ -1,371 +1,529 @@
 #include "flaggedarrayset.h"
 
-#include <map>
-#include <set>
 #include <vector>
-#include <list>
-#include <thread>
+#include <unordered_map>
 #include <mutex>
+#include <algorithm>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <random>
+
+#include "crypto/siphash.h"
 
 /******************************
  **** FlaggedArraySet util ****
  ******************************/
-struct PtrPair {
-	std::shared_ptr<std::vector<unsigned char> > elem;
-	std::shared_ptr<std::vector<unsigned char> > elemHash;
-	PtrPair(const std::shared_ptr<std::vector<unsigned char> >& elemIn, const std::shared_ptr<std::vector<unsigned char> >& elemHashIn) :
-		elem(elemIn), elemHash(elemHashIn) {}
-};
-
-struct SharedPtrElem {
-	PtrPair e;
-	bool operator==(const SharedPtrElem& o) const { return *e.elemHash == *o.e.elemHash; }
-	bool operator!=(const SharedPtrElem& o) const { return *e.elemHash != *o.e.elemHash; }
-	bool operator< (const SharedPtrElem& o) const { return *e.elemHash <  *o.e.elemHash; }
-	bool operator<=(const SharedPtrElem& o) const { return *e.elemHash <= *o.e.elemHash; }
-	bool operator> (const SharedPtrElem& o) const { return *e.elemHash >  *o.e.elemHash; }
-	bool operator>=(const SharedPtrElem& o) const { return *e.elemHash >= *o.e.elemHash; }
-	SharedPtrElem(const PtrPair& eIn) : e(eIn) {}
+// Lookups are keyed on SipHash with a random per-process key, so that txn spending the same
+// prevout (or crafted to) don't pile up in one bucket
+struct SipKeys {
+	uint64_t k0, k1;
+	SipKeys() {
+		std::random_device rand;
+		k0 = (uint64_t(rand()) << 32) | rand();
+		k1 = (uint64_t(rand()) << 32) | rand();
+	}
 };
+static const SipKeys& sip_keys() {
+	static SipKeys keys;
+	return keys;
+}
 
-class Deduper {
-private:
-	std::mutex dedup_mutex;
-	std::set<FlaggedArraySet*> allArraySets;
-	std::thread dedup_thread;
-public:
-	Deduper()
-		: dedup_thread([&]() {
-#ifdef PRECISE_BENCH
-			return;
-#endif
-			while (true) {
-				bool haveMultipleSets = false;
-				{
-					std::lock_guard<std::mutex> lock(dedup_mutex);
-					haveMultipleSets = allArraySets.size() > 1;
-				}
-
-				if (haveMultipleSets) {
-					std::list<PtrPair> ptrlist;
-
-					{
-						std::lock_guard<std::mutex> lock(dedup_mutex);
-						for (FlaggedArraySet* fas : allArraySets) {
-							if (!fas->mutex.try_lock())
-								continue;
-							std::lock_guard<WaitCountMutex> lock(fas->mutex, std::adopt_lock);
-							for (const auto& e : fas->backingMap) {
-								if (fas->mutex.wait_count())
-									break;
-								assert(e.first.elem);
-								ptrlist.push_back(PtrPair(e.first.elem, e.first.elemHash));
-							}
-						}
-					}
-
-					std::set<SharedPtrElem> txset;
-					std::map<std::vector<unsigned char>*, PtrPair> duplicateMap;
-					std::list<PtrPair> deallocList;
-					for (const auto& ptr : ptrlist) {
-						assert(ptr.elemHash);
-						auto res = txset.insert(SharedPtrElem(ptr));
-						if (!res.second && res.first->e.elem != ptr.elem)
-							duplicateMap.insert(std::make_pair(&(*ptr.elem), res.first->e));
-					}
-
-					int dedups = 0;
-					{
-						std::lock_guard<std::mutex> lock(dedup_mutex);
-						for (FlaggedArraySet* fas : allArraySets) {
-							if (!fas->mutex.try_lock())
-								continue;
-							std::lock_guard<WaitCountMutex> lock(fas->mutex, std::adopt_lock);
-							for (auto& e : fas->backingMap) {
-								if (fas->mutex.wait_count())
-									break;
-								assert(e.first.elem);
-								auto it = duplicateMap.find(&(*e.first.elem));
-								if (it != duplicateMap.end()) {
-									assert(*it->second.elem == *e.first.elem);
-									assert(*it->second.elemHash == *e.first.elemHash);
-									deallocList.emplace_back(it->second);
-									const_cast<ElemAndFlag&>(e.first).elem.swap(deallocList.back().elem);
-									const_cast<ElemAndFlag&>(e.first).elemHash.swap(deallocList.back().elemHash);
-									dedups++;
-								}
-							}
-						}
-					}
-#ifdef FOR_TEST
-					if (dedups)
-						printf("Deduped %d txn\n", dedups);
-#endif
-				}
-#ifdef FOR_TEST
-				std::this_thread::sleep_for(std::chrono::milliseconds(5));
-#else
-				std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-#endif
-			}
-		})
-	{}
+static inline uint64_t sip_hash(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end) {
+	return SipHash(sip_keys().k0, sip_keys().k1, &(*begin), end - begin);
+}
 
-	~Deduper() {
-		//TODO: close thread
-	}
+// For lookups by txid (hashIndex and the TxStore)
+static inline uint64_t hash_index_key(const unsigned char* elemHash) {
+	return SipHashUint256(sip_keys().k0, sip_keys().k1, elemHash);
+}
 
-	void addFAS(FlaggedArraySet* fas) {
-		std::lock_guard<std::mutex> lock(dedup_mutex);
-		allArraySets.insert(fas);
+// Every FAS in the process (the global compressors and one pair per client) refers to the same
+// copy of a transaction: add() interns each element by its hash here, and an entry lives on only
+// as long as some cache (or anyone else) still holds the element.
+class TxStore {
+private:
+	struct Key {
+		unsigned char hash[32];
+		bool operator==(const Key& o) const { return !memcmp(hash, o.hash, sizeof(hash)); }
+	};
+	struct KeyHash {
+		size_t operator()(const Key& k) const { return hash_index_key(k.hash); }
+	};
+	struct Entry {
+		std::weak_ptr<std::vector<unsigned char> > elem;
+	};
+
+	std::mutex mutex;
+	std::unordered_map<Key, Entry, KeyHash> entries;
+	size_t next_sweep_bucket = 0;
+
+	void sweep_bucket() {
+		size_t bucket = next_sweep_bucket++ % entries.bucket_count();
+		Key dead[4];
+		size_t dead_count = 0;
+		for (auto it = entries.begin(bucket); it != entries.end(bucket) && dead_count < 4; it++)
+			if (it->second.elem.expired())
+				dead[dead_count++] = it->first;
+		for (size_t i = 0; i < dead_count; i++)
+			entries.erase(dead[i]);
 	}
 
-	void removeFAS(FlaggedArraySet* fas) {
-		std::lock_guard<std::mutex> lock(dedup_mutex);
-		allArraySets.erase(fas);
+public:
+	// Replaces e.elem with the shared copy if the element is already known, otherwise makes e's copy
+	// the shared one
+	void intern(ElemAndFlag& e) {
+		assert(e.elem);
+		Key key;
+		memcpy(key.hash, e.elemHash, sizeof(key.hash));
+
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry& entry = entries[key];
+		std::shared_ptr<std::vector<unsigned char> > elem = entry.elem.lock();
+		if (elem) {
+			assert(*elem == *e.elem);
+			e.elem.swap(elem);
+		} else
+			entry.elem = e.elem;
+
+		// Each intern adds at most one entry and checks the next couple of buckets for dead ones, so
+		// the sweep laps the map faster than it grows without ever scanning it all under the lock
+		for (int i = 0; i < 2; i++)
+			sweep_bucket();
 	}
 };
 
-static Deduper* deduper;
+static TxStore tx_store;
+
+// sanity_check() walks the whole set, so running it on every change makes each O(n); only do so in
+// builds which ask for it (make variant=checkedtest)
+#ifdef FAS_SANITY_CHECKS
+#define FAS_SANITY_CHECK() assert(sanity_check())
+#else
+#define FAS_SANITY_CHECK() do {} while (0)
+#endif
 
 FlaggedArraySet::FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn) :
-		maxSize(maxSizeIn), maxFlagCount(maxFlagCountIn), backingMap(maxSize) {
+		maxSize(maxSizeIn), maxFlagCount(maxFlagCountIn), evictions(0), prioritized(false) {
 	clear();
-	if (!deduper)
-		deduper = new Deduper();
-	deduper->addFAS(this);
 }
 
 FlaggedArraySet::~FlaggedArraySet() {
-	deduper->removeFAS(this);
-	assert(sanity_check());
+	FAS_SANITY_CHECK();
 }
 
 
-ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint32_t flagIn, bool setHash) :
-	flag(flagIn), elem(elemIn)
+ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint64_t sipHashIn, uint32_t flagIn, uint64_t priorityIn) :
+	flag(flagIn), sipHash(sipHashIn), priority(priorityIn), elem(elemIn)
 {
-	if (setHash) {
-		elemHash = std::make_shared<std::vector<unsigned char> >(32);
-		double_sha256(&(*elem)[0], &(*elemHash)[0], elem->size());
-	}
+	double_sha256(&(*elem)[0], elemHash, elem->size());
 }
-ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemHashIn, std::nullptr_t) :
-	elemHash(elemHashIn) {}
-ElemAndFlag::ElemAndFlag(const std::vector<unsigned char>::const_iterator& elemBeginIn, const std::vector<unsigned char>::const_iterator& elemEndIn, uint32_t flagIn) :
-	flag(flagIn), elemBegin(elemBeginIn), elemEnd(elemEndIn) {}
-
-bool ElemAndFlag::operator == (const ElemAndFlag& o) const {
-	if ((elem && o.elem) || (elemHash && o.elemHash)) {
-		bool hashSet = o.elemHash && elemHash;
-		return o.elem == elem ||
-			(hashSet && *o.elemHash == *elemHash) ||
-			(!hashSet && *o.elem == *elem);
-	} else {
-		std::vector<unsigned char>::const_iterator o_begin, o_end, e_begin, e_end;
-		if (elem) {
-			e_begin = elem->begin();
-			e_end = elem->end();
-		} else {
-			e_begin = elemBegin;
-			e_end = elemEnd;
-		}
-		if (o.elem) {
-			o_begin = o.elem->begin();
-			o_end = o.elem->end();
-		} else {
-			o_begin = o.elemBegin;
-			o_end = o.elemEnd;
-		}
-		return o_end - o_begin == e_end - e_begin && !memcmp(&(*o_begin), &(*e_begin), o_end - o_begin);
+
+
+void FASIndex::reset(size_t count) {
+	used = 0;
+	if (!count) {
+		std::vector<Bucket>().swap(table);
+		return;
 	}
+
+	size_t size = 64;
+	while (size < (count + 1) * 2)
+		size *= 2;
+	table.assign(size, Bucket { 0, EMPTY });
+}
+
+void FASIndex::insert(uint64_t hash, uint32_t slot) {
+	assert(!full() && slot < TOMBSTONE);
+	size_t mask = table.size() - 1, i = hash & mask;
+	while (table[i].slot != EMPTY && table[i].slot != TOMBSTONE)
+		i = (i + 1) & mask;
+	if (table[i].slot == EMPTY)
+		used++;
+	table[i].tag = hash >> 32;
+	table[i].slot = slot;
 }
 
-size_t std::hash<ElemAndFlag>::operator()(const ElemAndFlag& e) const {
-	std::vector<unsigned char>::const_iterator it, end;
-	if (e.elem) {
-		it = e.elem->begin();
-		end = e.elem->end();
-	} else {
-		it = e.elemBegin;
-		end = e.elemEnd;
+void FASIndex::erase(uint64_t hash, uint32_t slot) {
+	size_t mask = table.size() - 1, i = hash & mask;
+	while (table[i].slot != slot) {
+		assert(table[i].slot != EMPTY);
+		i = (i + 1) & mask;
 	}
+	table[i].slot = TOMBSTONE;
+}
+
+
+// rank_tree is a Fenwick tree over slots holding a 1 for each slot whose element is still present
+uint32_t FlaggedArraySet::rank_(size_t slot) const {
+	uint32_t res = 0;
+	for (size_t i = slot; i; i -= i & -i)
+		res += rank_tree[i];
+	return res;
+}
+
+size_t FlaggedArraySet::select_(uint32_t index) const {
+	size_t size = slots.size(), pos = 0, step = 1;
+	while (step * 2 <= size)
+		step *= 2;
 
-	if (end - it < 5 + 32 + 4) {
-		assert(0);
-		return 42; // WAT?
+	uint32_t remaining = index + 1;
+	for (; step; step /= 2) {
+		if (pos + step <= size && rank_tree[pos + step] < remaining) {
+			pos += step;
+			remaining -= rank_tree[pos];
+		}
 	}
-	it += 5 + 32 + 4 - 8;
-	size_t res = 0;
-	static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8, "Your size_t is neither 32-bit nor 64-bit?");
-	for (unsigned int i = 0; i < 8; i += sizeof(size_t)) {
-		for (unsigned int j = 0; j < sizeof(size_t); j++)
-			res ^= *(it + i + j) << 8*j;
+	assert(pos < size && slots[pos].elem);
+	return pos;
+}
+
+uint32_t FlaggedArraySet::find_(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const {
+	return find_(sip_hash(start, end), start, end);
+}
+
+uint32_t FlaggedArraySet::find_(uint64_t sipHash, const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const {
+	size_t size = end - start;
+	return byElem.find(sipHash, [&](uint32_t slot) {
+		const std::vector<unsigned char>& e = *slots[slot].elem;
+		return e.size() == size && !memcmp(&e[0], &(*start), size);
+	});
+}
+
+bool FlaggedArraySet::contains_(const unsigned char* elemHash) const {
+	return byHash.find(hash_index_key(elemHash), [&](uint32_t slot) {
+		return !memcmp(slots[slot].elemHash, elemHash, 32);
+	}) != FASIndex::EMPTY;
+}
+
+void FlaggedArraySet::remove_slot(size_t slot) {
+	ElemAndFlag& e = slots[slot];
+	assert(slot < slots.size() && e.elem);
+	flag_count -= e.flag;
+	live--;
+
+	byElem.erase(e.sipHash, slot);
+	byHash.erase(hash_index_key(e.elemHash), slot);
+	if (prioritized)
+		evictOrder.erase(std::make_pair(e.priority, uint32_t(slot)));
+	e.elem.reset();
+
+	for (size_t i = slot + 1; i < rank_tree.size(); i += i & -i)
+		rank_tree[i]--;
+}
+
+void FlaggedArraySet::rebuild_indexes(size_t count) {
+	byElem.reset(count);
+	byHash.reset(count);
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].elem) {
+			byElem.insert(slots[i].sipHash, i);
+			byHash.insert(hash_index_key(slots[i].elemHash), i);
+		}
 	}
-	return res;
 }
 
+// Drops the slots of removed elements once they outnumber the live ones, so that slots stays O(size())
+void FlaggedArraySet::maybe_compact() {
+	if (slots.size() < live * 2 + 64)
+		return;
+
+	size_t write = 0;
+	for (size_t read = 0; read < slots.size(); read++)
+		if (slots[read].elem)
+			std::swap(slots[write++], slots[read]);
+	assert(write == live);
+	slots.erase(slots.begin() + write, slots.end());
+	rank_tree.resize(write + 1);
+	for (size_t i = 1; i <= write; i++)
+		rank_tree[i] = i & -i;
+
+	rebuild_indexes(live);
+	if (prioritized)
+		rebuild_evict_order();
+}
+
+void FlaggedArraySet::rebuild_evict_order() {
+	evictOrder.clear();
+	for (size_t i = 0; i < slots.size(); i++)
+		if (slots[i].elem)
+			evictOrder.insert(std::make_pair(slots[i].priority, uint32_t(i)));
+}
+
+size_t FlaggedArraySet::eviction_slot_() const {
+	assert(live);
+	if (prioritized)
+		return evictOrder.begin()->second;
+	return select_(0);
+}
 
 bool FlaggedArraySet::sanity_check() const {
-	size_t size = indexMap.size();
-	assert(backingMap.size() == size);
-	assert(this->size() == size - to_be_removed.size());
+	size_t size = 0;
+	std::vector<uint32_t> prefix(slots.size() + 1);
 
 	uint64_t expected_flag_count = 0;
-	for (uint64_t i = 0; i < size; i++) {
-		std::unordered_map<ElemAndFlag, uint64_t>::iterator it = indexMap.at(i);
-		assert(it != backingMap.end());
-		assert(it->second == i + offset);
-		assert(backingMap.find(it->first) == it);
-		assert(&backingMap.find(it->first)->first == &it->first);
-		expected_flag_count += it->first.flag;
+	for (size_t i = 0; i < slots.size(); i++) {
+		prefix[i + 1] = prefix[i] + (slots[i].elem ? 1 : 0);
+		if (!slots[i].elem)
+			continue;
+		assert(find_(slots[i].elem->begin(), slots[i].elem->end()) == i);
+		assert(contains_(slots[i].elemHash));
+		expected_flag_count += slots[i].flag;
+		size++;
 	}
+	assert(live == size);
 	assert(expected_flag_count == flag_count);
 
-	uint64_t expected_flags_removed = 0;
-	for (size_t i = 0; i < to_be_removed.size(); i++) {
-		std::unordered_map<ElemAndFlag, uint64_t>::iterator it = indexMap.at(to_be_removed[i] + i);
-		expected_flags_removed += it->first.flag;
-	}
-	assert(expected_flags_removed == flags_to_remove);
+	assert(rank_tree.size() == slots.size() + 1 || (slots.empty() && rank_tree.empty()));
+	for (size_t i = 1; i <= slots.size(); i++)
+		assert(rank_tree[i] == prefix[i] - prefix[i - (i & -i)]);
+
+	if (prioritized) {
+		assert(evictOrder.size() == live);
+		for (const std::pair<uint64_t, uint32_t>& p : evictOrder)
+			assert(p.second < slots.size() && slots[p.second].elem && slots[p.second].priority == p.first);
+	} else
+		assert(evictOrder.empty());
 
 	assert(this->size() <= maxSize);
 	assert(flagCount() <= maxFlagCount);
 
-	return expected_flags_removed == flags_to_remove && expected_flag_count == flag_count;
+	return expected_flag_count == flag_count;
+}
+
+bool FlaggedArraySet::contains(const std::shared_ptr<std::vector<unsigned char> >& e) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return find_(e->begin(), e->end()) != FASIndex::EMPTY;
 }
 
-void FlaggedArraySet::remove_(size_t index) {
-	auto& rm = indexMap[index];
-	assert(index < indexMap.size());
-	flag_count -= rm->first.flag;
+bool FlaggedArraySet::contains(const unsigned char* elemHash) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return contains_(elemHash);
+}
 
-	size_t size = backingMap.size();
+void FlaggedArraySet::make_room(uint32_t flag, std::vector<uint32_t>& evicted) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!live || (size() + 1 <= maxSize && flagCount() + flag <= maxFlagCount))
+		return;
 
-	if (index < size/2) {
-		for (uint64_t i = 0; i < index; i++)
-			indexMap[i]->second++;
-		offset++;
-	} else
-		for (uint64_t i = index + 1; i < size; i++)
-			indexMap[i]->second--;
-	backingMap.erase(rm);
-	indexMap.erase(indexMap.begin() + index);
-}
-
-void FlaggedArraySet::cleanup_late_remove() const {
-	assert(sanity_check());
-	if (to_be_removed.size()) {
-		for (unsigned int i = 0; i < to_be_removed.size(); i++) {
-			assert((unsigned int)to_be_removed[i] < indexMap.size());
-			const_cast<FlaggedArraySet*>(this)->remove_(to_be_removed[i]);
-		}
-		to_be_removed.clear();
-		flags_to_remove = 0;
-		max_remove = 0;
+	while (live && (size() + 1 > maxSize || flagCount() + flag > maxFlagCount)) {
+		size_t slot = eviction_slot_();
+		evicted.push_back(rank_(slot));
+		remove_slot(slot);
+		evictions++;
 	}
-	assert(sanity_check());
-}
+	maybe_compact();
 
-bool FlaggedArraySet::contains(const std::shared_ptr<std::vector<unsigned char> >& e) const {
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	cleanup_late_remove();
-	return backingMap.count(ElemAndFlag(e, 0, false));
+	FAS_SANITY_CHECK();
 }
 
-bool FlaggedArraySet::contains(const unsigned char* elemHash) const {
-	//TODO: Come up with a cheap way to optimize this?
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	cleanup_late_remove();
-	ElemAndFlag e(std::make_shared<std::vector<unsigned char> >(elemHash, elemHash + 32), NULL);
-	for (const std::unordered_map<ElemAndFlag, uint64_t>::iterator& it : indexMap)
-		if (it->first == e)
-			return true;
-	return false;
+void FlaggedArraySet::add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag, uint64_t priority) {
+	add_(e, flag, priority, true);
 }
 
 void FlaggedArraySet::add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag) {
-	ElemAndFlag elem(e, flag, true);
+	add_(e, flag, 0, false);
+}
+
+void FlaggedArraySet::add_(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag, uint64_t priority, bool has_priority) {
+	// The txid is only worked out, and the tx interned, once it is known to be going in. Neither is
+	// done under the lock, so the check is repeated after.
+	uint64_t sipHash = sip_hash(e->begin(), e->end());
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// An unprioritized add to a prioritized set would go in at priority 0, first in line for eviction
+		assert(has_priority || !prioritized);
+		if (find_(sipHash, e->begin(), e->end()) != FASIndex::EMPTY)
+			return;
+	}
 
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	cleanup_late_remove();
+	ElemAndFlag elem(e, sipHash, flag, priority);
+	tx_store.intern(elem);
 
-	auto res = backingMap.insert(std::make_pair(elem, size() + offset));
-	if (!res.second)
+	std::lock_guard<std::mutex> lock(mutex);
+	if (find_(sipHash, e->begin(), e->end()) != FASIndex::EMPTY)
 		return;
 
-	indexMap.push_back(res.first);
+	if (byElem.full() || byHash.full())
+		rebuild_indexes(live + 1);
+	if (rank_tree.empty())
+		rank_tree.push_back(0);
+	uint32_t slot = slots.size();
+	byElem.insert(elem.sipHash, slot);
+	byHash.insert(hash_index_key(elem.elemHash), slot);
+	slots.push_back(std::move(elem));
+	if (prioritized)
+		evictOrder.insert(std::make_pair(priority, slot));
+	else if (priority) {
+		prioritized = true;
+		rebuild_evict_order();
+	}
+
+	size_t i = slots.size();
+	uint32_t node = 1;
+	for (size_t j = i - 1; j > i - (i & -i); j -= j & -j)
+		node += rank_tree[j];
+	rank_tree.push_back(node);
+
+	live++;
 	flag_count += flag;
 
 	assert(size() <= maxSize + 1);
 	assert(flagCount() <= maxFlagCount + flag);
-	while (size() > maxSize || flagCount() > maxFlagCount)
-		remove_(0);
+	while (size() > maxSize || flagCount() > maxFlagCount) {
+		remove_slot(eviction_slot_());
+		evictions++;
+	}
+	maybe_compact();
 
-	assert(sanity_check());
+	FAS_SANITY_CHECK();
 }
 
-int FlaggedArraySet::remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) {
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	cleanup_late_remove();
+int FlaggedArraySet::remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end, unsigned char* elemHashRes) {
+	std::lock_guard<std::mutex> lock(mutex);
 
-	auto it = backingMap.find(ElemAndFlag(start, end, 0));
-	if (it == backingMap.end())
+	uint32_t slot = find_(start, end);
+	if (slot == FASIndex::EMPTY)
 		return -1;
 
-	int res = it->second - offset;
-	remove_(res);
+	if (elemHashRes)
+		memcpy(elemHashRes, slots[slot].elemHash, 32);
 
-	assert(sanity_check());
+	int res = rank_(slot);
+	remove_slot(slot);
+	maybe_compact();
+
+	FAS_SANITY_CHECK();
 	return res;
 }
 
-bool FlaggedArraySet::remove(unsigned int index, std::vector<unsigned char>& elemRes, unsigned char* elemHashRes) {
-	std::lock_guard<WaitCountMutex> lock(mutex);
+int FlaggedArraySet::index_of(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const {
+	std::lock_guard<std::mutex> lock(mutex);
 
-	if (index < max_remove)
-		cleanup_late_remove();
-	int lookup_index = index + to_be_removed.size();
+	uint32_t slot = find_(start, end);
+	if (slot == FASIndex::EMPTY)
+		return -1;
+	return rank_(slot);
+}
 
-	if ((unsigned int)lookup_index >= indexMap.size())
+bool FlaggedArraySet::remove(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (index >= size())
 		return false;
 
-	const ElemAndFlag& e = indexMap[lookup_index]->first;
-	assert(e.elem && e.elemHash);
-	memcpy(elemHashRes, &(*e.elemHash)[0], 32);
-	elemRes = *e.elem;
-
-	if (index >= max_remove) {
-		to_be_removed.push_back(index);
-		max_remove = index;
-		flags_to_remove += e.flag;
-	} else {
-		cleanup_late_remove();
-		remove_(index);
-	}
+	size_t slot = select_(index);
+	const ElemAndFlag& e = slots[slot];
+	memcpy(elemHashRes, e.elemHash, 32);
+	elemRes = e.elem;
+
+	remove_slot(slot);
+	maybe_compact();
+
+	FAS_SANITY_CHECK();
+	return true;
+}
+
+bool FlaggedArraySet::get(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes) const {
+	std::lock_guard<std::mutex> lock(mutex);
 
-	assert(sanity_check());
+	if (index >= size())
+		return false;
+
+	const ElemAndFlag& e = slots[select_(index)];
+	memcpy(elemHashRes, e.elemHash, 32);
+	elemRes = e.elem;
 	return true;
 }
 
+void FlaggedArraySet::remove_sorted(const std::vector<uint32_t>& indexes, std::vector<std::shared_ptr<std::vector<unsigned char> > >* removed) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (indexes.empty())
+		return;
+
+	// Positions are relative to the set before any removal, so find every slot first
+	std::vector<size_t> rm(indexes.size());
+	for (size_t i = 0; i < indexes.size(); i++) {
+		assert(i == 0 || indexes[i - 1] < indexes[i]);
+		rm[i] = select_(indexes[i]);
+	}
+	for (size_t slot : rm) {
+		if (removed)
+			removed->push_back(slots[slot].elem);
+		remove_slot(slot);
+	}
+	maybe_compact();
+
+	FAS_SANITY_CHECK();
+}
+
+void FlaggedArraySet::remove_batch(const std::vector<std::pair<std::vector<unsigned char>::const_iterator, std::vector<unsigned char>::const_iterator> >& elems,
+		std::vector<int>& indexes, unsigned char* elemHashesRes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	indexes.resize(elems.size());
+
+	for (size_t i = 0; i < elems.size(); i++) {
+		uint32_t slot = find_(elems[i].first, elems[i].second);
+		if (slot == FASIndex::EMPTY) {
+			indexes[i] = -1;
+			continue;
+		}
+
+		if (elemHashesRes)
+			memcpy(elemHashesRes + 32 * i, slots[slot].elemHash, 32);
+		indexes[i] = rank_(slot);
+		remove_slot(slot);
+	}
+	maybe_compact();
+
+	FAS_SANITY_CHECK();
+}
+
 void FlaggedArraySet::clear() {
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	if (!indexMap.empty() && !backingMap.empty())
-		assert(sanity_check());
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!slots.empty())
+		FAS_SANITY_CHECK();
+
+	flag_count = 0; live = 0;
+	// Nothing is allocated until the first add(), so idle and cleared sets cost next to nothing
+	std::vector<ElemAndFlag>().swap(slots);
+	std::vector<uint32_t>().swap(rank_tree);
+	byElem.reset(0);
+	byHash.reset(0);
+	prioritized = false;
+	std::set<std::pair<uint64_t, uint32_t> >().swap(evictOrder);
+}
 
-	flag_count = 0; offset = 0;
-	flags_to_remove = 0; max_remove = 0;
-	backingMap.clear(); indexMap.clear(); to_be_removed.clear();
+FlaggedArraySet& FlaggedArraySet::operator=(const FlaggedArraySet& o) {
+	if (this == &o)
+		return *this;
+	std::lock(mutex, o.mutex);
+	std::lock_guard<std::mutex> lock(mutex, std::adopt_lock), o_lock(o.mutex, std::adopt_lock);
+	maxSize = o.maxSize;
+	maxFlagCount = o.maxFlagCount;
+	flag_count = o.flag_count;
+	evictions = o.evictions;
+	live = o.live;
+	slots = o.slots;
+	rank_tree = o.rank_tree;
+	byElem = o.byElem;
+	byHash = o.byHash;
+	prioritized = o.prioritized;
+	evictOrder = o.evictOrder;
+	return *this;
 }
 
 void FlaggedArraySet::for_all_txn(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) const {
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	cleanup_late_remove();
-	for (const auto& e : indexMap) {
-		assert(e->first.elem);
-		callback(e->first.elem);
-	}
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const ElemAndFlag& e : slots)
+		if (e.elem)
+			callback(e.elem);
+}
+
+void FlaggedArraySet::for_all_hashes(const std::function<void (uint32_t, const unsigned char*)>& callback) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	uint32_t pos = 0;
+	for (const ElemAndFlag& e : slots)
+		if (e.elem)
+			callback(pos++, e.elemHash);
 }
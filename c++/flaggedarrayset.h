@@ -2,9 +2,8 @@
 #define _RELAY_FLAGGEDARRAYSET_H
 
 #include <vector>
-#include <thread>
-#include <map>
-#include <unordered_map>
+#include <set>
+#include <mutex>
 #include <cstddef>
 
 #include "utils.h"
@@ -14,80 +13,122 @@
  ******************************/
 struct ElemAndFlag {
 	uint32_t flag;
-	std::shared_ptr<std::vector<unsigned char> > elem, elemHash;
-	std::vector<unsigned char>::const_iterator elemBegin, elemEnd;
-	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint32_t flagIn, bool setHash);
-	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemHashIn, std::nullptr_t);
-	ElemAndFlag(const std::vector<unsigned char>::const_iterator& elemBegin, const std::vector<unsigned char>::const_iterator& elemEnd, uint32_t flagIn);
-	bool operator == (const ElemAndFlag& o) const;
+	uint64_t sipHash; // Keyed hash of the element's bytes
+	uint64_t priority; // Lower is evicted first
+	unsigned char elemHash[32];
+	std::shared_ptr<std::vector<unsigned char> > elem; // Interned, so shared with every other set holding the same tx
+	// sipHashIn must be sip_hash() of elemIn's bytes
+	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint64_t sipHashIn, uint32_t flagIn, uint64_t priorityIn);
 };
-namespace std {
-	template <> struct hash<ElemAndFlag> {
-		size_t operator()(const ElemAndFlag& e) const;
-	};
-}
 
+// Open-addressed table from a 64-bit hash to a FlaggedArraySet slot. Each bucket is just the top 32
+// bits of the hash and the slot, so a probe reads one or two cache lines before looking at the slot.
+class FASIndex {
+private:
+	struct Bucket {
+		uint32_t tag, slot;
+	};
+	std::vector<Bucket> table;
+	size_t used;
 
+public:
+	static const uint32_t EMPTY = 0xffffffff, TOMBSTONE = 0xfffffffe;
+
+	FASIndex() : used(0) {}
+	// Empties the table, sizing it for count entries (freeing it if count is 0)
+	void reset(size_t count);
+	// True if another insert would leave the table (erased entries included) over 3/4 full
+	bool full() const { return (used + 1) * 4 > table.size() * 3; }
+
+	// Returns the first slot for hash which match(slot) accepts, or EMPTY
+	template<typename F> uint32_t find(uint64_t hash, const F& match) const {
+		if (table.empty())
+			return EMPTY;
+		size_t mask = table.size() - 1;
+		for (size_t i = hash & mask; table[i].slot != EMPTY; i = (i + 1) & mask)
+			if (table[i].slot != TOMBSTONE && table[i].tag == uint32_t(hash >> 32) && match(table[i].slot))
+				return table[i].slot;
+		return EMPTY;
+	}
+	void insert(uint64_t hash, uint32_t slot);
+	void erase(uint64_t hash, uint32_t slot);
+};
 
 class FlaggedArraySet {
 private:
-	uint64_t maxSize, maxFlagCount, flag_count;
-	size_t offset;
-	std::unordered_map<ElemAndFlag, uint64_t> backingMap;
-	std::vector<std::unordered_map<ElemAndFlag, uint64_t>::iterator> indexMap;
-
-	// The mutex is only used by memory deduper, FlaggedArraySet is not thread-safe
-	// It is taken by changes to backingMap, any touches to backingMap in the deduper thread, or any touches to elem
-	friend class Deduper;
-	friend class FASLockHint;
-	mutable WaitCountMutex mutex;
-
-	mutable std::vector<int> to_be_removed;
-	mutable uint32_t max_remove;
-	mutable uint64_t flags_to_remove;
+	uint64_t maxSize, maxFlagCount, flag_count, evictions;
+	size_t live;
+	// Elements in insertion order. A removed element leaves an empty slot behind (its elem is
+	// reset) until the slots are compacted. An element's index is the number of live slots before
+	// its own, which rank_tree gives in O(log n).
+	std::vector<ElemAndFlag> slots;
+	std::vector<uint32_t> rank_tree;
+	// Slots by a keyed hash of their bytes, and of their hash (for contains(elemHash))
+	FASIndex byElem, byHash;
+	// Live slots by (priority, slot), kept only once some element has been given a priority. Until
+	// then every priority is 0 and the eviction order is simply insertion order.
+	bool prioritized;
+	std::set<std::pair<uint64_t, uint32_t> > evictOrder;
+
+	// Taken by every method, so that lookups from outside the owning compressor's locks (eg was_tx_sent) are safe
+	mutable std::mutex mutex;
 
 public:
 	void clear();
 	FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn);
 	~FlaggedArraySet();
 
-	size_t size() const { return backingMap.size() - to_be_removed.size(); }
-	uint64_t flagCount() const { return flag_count - flags_to_remove; }
+	size_t size() const { return live; }
+	uint64_t flagCount() const { return flag_count; }
+	// Number of elements pushed out by add() or make_room(), ever (it is not reset by clear())
+	uint64_t evictedCount() const { return evictions; }
 	bool contains(const std::shared_ptr<std::vector<unsigned char> >& e) const;
 	bool contains(const unsigned char* elemHash) const;
 
-	FlaggedArraySet& operator=(const FlaggedArraySet& o) {
-		o.cleanup_late_remove();
-		clear();
-
-		maxSize = o.maxSize;
-		maxFlagCount = o.maxFlagCount;
-		flag_count = o.flag_count;
-		offset = o.offset;
-		backingMap = o.backingMap;
-		indexMap = o.indexMap;
-		return *this;
-	}
+	FlaggedArraySet& operator=(const FlaggedArraySet& o);
 
 private:
 	bool sanity_check() const;
-	void remove_(size_t index);
-	void cleanup_late_remove() const;
+	uint32_t find_(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const;
+	uint32_t find_(uint64_t sipHash, const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const;
+	bool contains_(const unsigned char* elemHash) const;
+	uint32_t rank_(size_t slot) const;
+	size_t select_(uint32_t index) const;
+	void remove_slot(size_t slot);
+	void rebuild_indexes(size_t count);
+	void maybe_compact();
+	void rebuild_evict_order();
+	size_t eviction_slot_() const;
+	void add_(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag, uint64_t priority, bool has_priority);
 
 public:
+	// Elements are evicted lowest priority first, and oldest first among equal priorities, so that
+	// two sets given the same adds (with the same priorities) and removes always agree
+	void add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag, uint64_t priority);
+	// For sets which evict oldest first only, ie which are never given a priority
 	void add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag);
-	int remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end);
-	bool remove(unsigned int index, std::vector<unsigned char>& elemRes, unsigned char* elemHashRes);
+	// Evicts elements, in the order add() would, until one with the given flag fits without evicting
+	// anything, appending the position each had as it was removed to evicted
+	void make_room(uint32_t flag, std::vector<uint32_t>& evicted);
+	int remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end, unsigned char* elemHashRes=NULL);
+	// Returns the element's position, or -1 if it is not present
+	int index_of(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) const;
+	// Hands back a reference to the (now-removed) element instead of copying it out
+	bool remove(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes);
+
+	// Looks up the element at absolute position index without removing it
+	bool get(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes) const;
+	// Removes all elements at the given absolute positions (which must be strictly ascending) in one pass,
+	// appending them to removed (in the same order) if it is given
+	void remove_sorted(const std::vector<uint32_t>& indexes, std::vector<std::shared_ptr<std::vector<unsigned char> > >* removed=NULL);
+	// Removes each of elems in turn, setting indexes[i] to what remove() would have returned for it
+	// (and, if elemHashesRes is given, filling in its hash at 32*i if found), with one lock and one compaction
+	void remove_batch(const std::vector<std::pair<std::vector<unsigned char>::const_iterator, std::vector<unsigned char>::const_iterator> >& elems,
+			std::vector<int>& indexes, unsigned char* elemHashesRes=NULL);
 
 	void for_all_txn(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) const;
-};
-
-class FASLockHint {
-private:
-	WaitCountHint* hint;
-public:
-	FASLockHint(FlaggedArraySet& fas) : hint(new WaitCountHint(fas.mutex)) {}
-	~FASLockHint() { delete hint; }
+	// Calls callback with the position and hash of every element, in order
+	void for_all_hashes(const std::function<void (uint32_t, const unsigned char*)>& callback) const;
 };
 
 #endif
@@ -21,10 +21,13 @@
 class MempoolClient : public Connection {
 public:
 	MempoolClient(int fd_in, std::string hostIn) : Connection(fd_in, hostIn, NULL) { construction_done(); }
+	void send_hello(int send_mutex=0) {
+		do_send_bytes((const char*) MEMPOOL_LINK_HELLO, MEMPOOL_LINK_HELLO_BYTES, send_mutex);
+	}
 	void send_pool(std::set<std::vector<unsigned char> >::const_iterator mempool_begin, const std::set<std::vector<unsigned char> >::const_iterator mempool_end, int send_mutex=0) {
 		while (mempool_begin != mempool_end) {
-			assert(mempool_begin->size() == 32);
-			do_send_bytes((const char*) &(*mempool_begin)[0], 32, send_mutex);
+			assert(mempool_begin->size() == MEMPOOL_TX_RECORD_BYTES);
+			do_send_bytes((const char*) &(*mempool_begin)[0], MEMPOOL_TX_RECORD_BYTES, send_mutex);
 			mempool_begin++;
 		}
 	}
@@ -71,6 +74,7 @@ int main(int argc, char** argv) {
 
 	std::mutex mempool_mutex;
 	std::chrono::steady_clock::time_point last_mempool_request(std::chrono::steady_clock::time_point::min());
+	// Records of MEMPOOL_TX_RECORD_BYTES, so sorted by hash (a tx is only sent once, with its first fee)
 	vectormruset mempool(MAX_FAS_TOTAL_SIZE);
 
 	uint8_t i = 0;
@@ -78,7 +82,7 @@ int main(int argc, char** argv) {
 	uint32_t txn_sent = 0;
 	std::chrono::steady_clock::time_point last_mempool_print(std::chrono::steady_clock::now());
 	RPCClient rpcTrustedP2P("127.0.0.1", std::stoul(argv[2]),
-					[&](std::vector<std::pair<std::vector<unsigned char>, size_t> >& txn_list, size_t total_mempool_size) {
+					[&](std::vector<std::tuple<std::vector<unsigned char>, size_t, uint64_t> >& txn_list, size_t total_mempool_size) {
 						std::set<std::vector<unsigned char> > new_txn;
 						{
 							std::lock_guard<std::mutex> lock(mempool_mutex);
@@ -88,10 +92,16 @@ int main(int argc, char** argv) {
 							last_mempool_request = std::chrono::steady_clock::now();
 
 							for (const auto& txn : txn_list) {
-								if (mempool.insert(txn.first).second) {
-									new_txn.insert(txn.first);
-									size_gathered += txn.second;
-									bytes_sent += txn.second;
+								const std::vector<unsigned char>& hash = std::get<0>(txn);
+								auto it = mempool.lower_bound(hash);
+								if (it == mempool.end() || memcmp(&(*it)[0], &hash[0], 32)) {
+									std::vector<unsigned char> record(hash);
+									for (int i = 7; i >= 0; i--)
+										record.push_back((std::get<2>(txn) >> (8 * i)) & 0xff);
+									mempool.insert(record);
+									new_txn.insert(record);
+									size_gathered += std::get<1>(txn);
+									bytes_sent += std::get<1>(txn);
 									txn_sent++;
 								}
 								if (size_gathered >= size_to_gather)
@@ -162,6 +172,7 @@ int main(int argc, char** argv) {
 			fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
 
 			int send_mutex = client->get_send_mutex();
+			client->send_hello(send_mutex);
 			{
 				std::lock_guard<std::mutex> lock(mempool_mutex);
 				client->send_pool(mempool.begin(), mempool.end(), send_mutex);
@@ -7,7 +7,14 @@
 
 #include <deque>
 #include <set>
+#include <vector>
 #include <utility>
+#include <random>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "crypto/siphash.h"
 
 /** STL-like set container that only keeps the most recent N elements. */
 template <typename T> class mruset
@@ -31,6 +38,7 @@ public:
     size_type size() const { return set.size(); }
     bool empty() const { return set.empty(); }
     iterator find(const key_type& k) const { return set.find(k); }
+    iterator lower_bound(const key_type& k) const { return set.lower_bound(k); }
     size_type count(const key_type& k) const { return set.count(k); }
     void clear() { set.clear(); queue.clear(); }
     bool inline friend operator==(const mruset<T>& a, const mruset<T>& b) { return a.set == b.set; }
@@ -107,4 +115,128 @@ public:
     }
 };
 
+/**
+ * mruset of 32-byte hashes, for sets of block hashes large enough that a std::set node and a
+ * std::deque copy per entry add up: hashes are kept back to back in a ring (oldest overwritten
+ * first) and found through an open-addressed table of ring positions.
+ */
+class hashmruset
+{
+private:
+    static const uint32_t TOMBSTONE = 0xffffffff;
+
+    std::vector<unsigned char> keys;
+    std::vector<bool> live;
+    std::vector<uint32_t> table; // 0 if empty, TOMBSTONE if erased, otherwise ring position + 1
+    uint32_t nMaxSize, head, elements, used;
+    uint64_t k0, k1;
+
+    size_t bucket(const unsigned char* hash) const
+    {
+        return SipHashUint256(k0, k1, hash) & (table.size() - 1);
+    }
+
+    // Returns the table position holding hash, or table.size() if it is not present
+    size_t find(const unsigned char* hash) const
+    {
+        if (table.empty())
+            return 0;
+        for (size_t i = bucket(hash); ; i = (i + 1) & (table.size() - 1))
+        {
+            if (!table[i])
+                return table.size();
+            if (table[i] != TOMBSTONE && !memcmp(&keys[(table[i] - 1) * 32], hash, 32))
+                return i;
+        }
+    }
+
+    void place(uint32_t slot)
+    {
+        size_t i = bucket(&keys[slot * 32]);
+        while (table[i] && table[i] != TOMBSTONE)
+            i = (i + 1) & (table.size() - 1);
+        if (!table[i])
+            used++;
+        table[i] = slot + 1;
+    }
+
+    void remove(size_t pos)
+    {
+        live[table[pos] - 1] = false;
+        table[pos] = TOMBSTONE;
+        elements--;
+    }
+
+    void rebuild()
+    {
+        size_t size = 64;
+        while (size < (elements + 1) * 2)
+            size *= 2;
+        table.assign(size, 0);
+        used = 0;
+        for (uint32_t slot = 0; slot < live.size(); slot++)
+            if (live[slot])
+                place(slot);
+    }
+
+public:
+    hashmruset(uint32_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), head(0), elements(0), used(0)
+    {
+        std::random_device rand;
+        k0 = (uint64_t(rand()) << 32) | rand();
+        k1 = (uint64_t(rand()) << 32) | rand();
+    }
+
+    size_t size() const { return elements; }
+    size_t count(const std::vector<unsigned char>& hash) const
+    {
+        assert(hash.size() == 32);
+        return find(&hash[0]) != table.size();
+    }
+    void clear() { keys.clear(); live.clear(); table.clear(); head = elements = used = 0; }
+
+    size_t erase(const std::vector<unsigned char>& hash)
+    {
+        assert(hash.size() == 32);
+        size_t pos = find(&hash[0]);
+        if (pos == table.size())
+            return 0;
+        remove(pos);
+        return 1;
+    }
+
+    // Returns false if hash was already present
+    bool insert(const std::vector<unsigned char>& hash)
+    {
+        assert(hash.size() == 32 && nMaxSize);
+        if (count(hash))
+            return false;
+
+        // Keep the table (erased entries included) at most 3/4 full
+        if ((used + 1) * 4 > table.size() * 3)
+            rebuild();
+
+        uint32_t slot;
+        if (live.size() < nMaxSize)
+        {
+            slot = live.size();
+            keys.resize(keys.size() + 32);
+            live.push_back(false);
+        }
+        else
+        {
+            slot = head;
+            head = (head + 1) % nMaxSize;
+            if (live[slot])
+                remove(find(&keys[slot * 32]));
+        }
+
+        memcpy(&keys[slot * 32], &hash[0], 32);
+        live[slot] = true;
+        elements++;
+        place(slot);
+        return true;
+    }
+};
+
 #endif // BITCOIN_MRUSET_H
@@ -5,6 +5,7 @@
 #include <thread>
 #include <chrono>
 #include <string.h>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/time.h>
 #include <stdio.h>
@@ -73,6 +74,18 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 
 			if (memcmp((char*)hash, header.checksum, sizeof(header.checksum)))
 				return disconnect("got invalid message checksum");
+		} else if (prependedHeaderSize && provide_block_progress) {
+			// Hand out the block as it arrives so it can be relayed before we have all of it.
+			// The buffer is already full-size, so the callback may keep pointers into it until provide_block
+			for (uint32_t read = 0; read < header.length; ) {
+				uint32_t chunk = std::min(header.length - read, uint32_t(BLOCK_PROGRESS_CHUNK));
+				if (read_all((char*)&(*msg)[prependedHeaderSize + read], chunk) != ssize_t(chunk)) {
+					provide_block_progress(*msg, 0);
+					return disconnect("failed to read message");
+				}
+				read += chunk;
+				provide_block_progress(*msg, prependedHeaderSize + read);
+			}
 		} else
 			if (read_all((char*)&(*msg)[prependedHeaderSize], header.length) != ssize_t(header.length))
 				return disconnect("failed to read message");
@@ -154,7 +167,7 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 			resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), v.begin(), v.end());
 			send_message("getdata", &resp[0], resp.size() - sizeof(struct bitcoin_msg_header));
 		} else if (!strncmp(header.command, "block", strlen("block"))) {
-			provide_block(*msg, read_start);
+			provide_block(msg, read_start);
 		} else if (!strncmp(header.command, "tx", strlen("tx"))) {
 			provide_transaction(msg);
 		} else if (!strncmp(header.command, "headers", strlen("headers"))) {
@@ -195,18 +208,41 @@ void P2PRelayer::receive_transaction(const std::shared_ptr<std::vector<unsigned
 	}
 }
 
-void P2PRelayer::receive_block(std::vector<unsigned char>& block) {
+void P2PRelayer::receive_block(const BlockView& block) {
 	if (connected != 2)
 		return;
 	bool seen;
+	{
+		std::lock_guard<std::mutex> lock(seen_mutex);
+		seen = !blocksAlreadySeen.insert(block.get_hash()).second;
+	}
+	if (!seen) {
+		std::shared_ptr<std::vector<unsigned char> > msg = block.msg_bytes();
+		if (!msg) {
+			// Every relay path gives a view of a shared buffer, which is sent without a copy
+			msg = std::make_shared<std::vector<unsigned char> >(block.bytes());
+			prepare_message("block", &(*msg)[0], msg->size() - sizeof(bitcoin_msg_header), block.msg_checksum());
+		}
+		maybe_do_send_bytes(msg);
+	}
+}
+
+void P2PRelayer::receive_header(const unsigned char* header) {
+	if (connected != 2)
+		return;
 	{
 		std::lock_guard<std::mutex> lock(seen_mutex);
 		std::vector<unsigned char> hash(32);
-		getblockhash(hash, block, sizeof(bitcoin_msg_header));
-		seen = !blocksAlreadySeen.insert(hash).second;
+		double_sha256(header, &hash[0], 80);
+		if (blocksAlreadySeen.count(hash))
+			return;
 	}
-	if (!seen)
-		send_message("block", &block[0], block.size() - sizeof(bitcoin_msg_header));
+
+	std::vector<unsigned char> msg(sizeof(struct bitcoin_msg_header));
+	msg.push_back(1);
+	msg.insert(msg.end(), header, header + 80);
+	msg.push_back(0);
+	send_message("headers", &msg[0], msg.size() - sizeof(struct bitcoin_msg_header));
 }
 
 void P2PRelayer::request_transaction(const std::vector<unsigned char>& tx_hash) {
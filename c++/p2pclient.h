@@ -10,15 +10,20 @@
 
 #include "utils.h"
 #include "mruset.h"
+#include "blockview.h"
 #include "connection.h"
 
+// How much of a block is read between calls to provide_block_progress
+#define BLOCK_PROGRESS_CHUNK 8192
+
 
 class P2PRelayer : public KeepaliveOutboundPersistentConnection {
 private:
-	const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)> provide_block;
+	const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const std::chrono::system_clock::time_point&)> provide_block;
 	const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
 
 	const std::function<void (std::vector<unsigned char>&)> provide_headers;
+	const std::function<void (const std::vector<unsigned char>&, size_t)> provide_block_progress;
 
 	std::atomic<uint8_t> connected;
 
@@ -30,12 +35,14 @@ private:
 
 public:
 	P2PRelayer(const char* serverHostIn, uint16_t serverPortIn, uint64_t ping_time_nonce,
-				const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)>& provide_block_in,
+				const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const std::chrono::system_clock::time_point&)>& provide_block_in,
 				const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
 				const std::function<void (std::vector<unsigned char>&)> provide_headers_in = std::function<void (std::vector<unsigned char>&)>(),
-				bool check_block_msghash_in=true)
+				bool check_block_msghash_in=true,
+				const std::function<void (const std::vector<unsigned char>&, size_t)>& provide_block_progress_in = std::function<void (const std::vector<unsigned char>&, size_t)>())
 			: KeepaliveOutboundPersistentConnection(serverHostIn, serverPortIn, ping_time_nonce),
 			provide_block(provide_block_in), provide_transaction(provide_transaction_in), provide_headers(provide_headers_in),
+			provide_block_progress(provide_block_progress_in),
 			connected(0), txnAlreadySeen(2000), blocksAlreadySeen(100), check_block_msghash(check_block_msghash_in)
 	{}
 
@@ -50,7 +57,9 @@ protected:
 
 public:
 	void receive_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
-	void receive_block(std::vector<unsigned char>& block);
+	void receive_block(const BlockView& block);
+	// Announces a block to bitcoind by its 80-byte header alone, ahead of the block itself
+	void receive_header(const unsigned char* header);
 	void request_transaction(const std::vector<unsigned char>& txhash);
 
 	bool is_connected() const;
@@ -22,6 +22,7 @@
 
 #include "crypto/sha2.h"
 #include "utils.h"
+#include "blockview.h"
 #include "p2pclient.h"
 
 
@@ -30,7 +31,7 @@
 class P2PClient : public P2PRelayer {
 public:
 	P2PClient(const char* serverHostIn, uint16_t serverPortIn,
-				const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)>& provide_block_in,
+				const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const std::chrono::system_clock::time_point&)>& provide_block_in,
 				const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in) :
 			P2PRelayer(serverHostIn, serverPortIn, 30000, provide_block_in, provide_transaction_in)
 		{ construction_done(); }
@@ -68,20 +69,27 @@ int main(int argc, char** argv) {
 
 	P2PClient* inbound;
 	P2PClient outbound(argv[1], std::stoul(argv[2]),
-					[&](std::vector<unsigned char>& bytes, const std::chrono::system_clock::time_point&) {
+					[&](const std::shared_ptr<std::vector<unsigned char> >& bytes, const std::chrono::system_clock::time_point&) {
 						struct timeval tv;
 						gettimeofday(&tv, NULL);
-						inbound->receive_block(bytes);
+						if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
+							return;
+						BlockView block(bytes);
+						inbound->receive_block(block);
 
-						std::vector<unsigned char> fullhash(32);
-						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
+						const std::vector<unsigned char>& fullhash = block.get_hash();
 						for (unsigned int i = 0; i < fullhash.size(); i++)
 							printf("%02x", fullhash[fullhash.size() - i - 1]);
 						printf(" recv'd %s %lu\n", argv[1], uint64_t(tv.tv_sec)*1000 + uint64_t(tv.tv_usec)/1000);
 					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) { inbound->receive_transaction(bytes); });
 	inbound = new P2PClient(argv[3], 8334,
-					[&](std::vector<unsigned char>& bytes, const std::chrono::system_clock::time_point&) { outbound.receive_block(bytes); },
+					[&](const std::shared_ptr<std::vector<unsigned char> >& bytes, const std::chrono::system_clock::time_point&) {
+						if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
+							return;
+						BlockView block(bytes);
+						outbound.receive_block(block);
+					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) { });
 
 	while (true) { sleep(1000); }
@@ -1,46 +1,96 @@
 #include "relayprocess.h"
 
 #include "crypto/sha2.h"
+#include "crypto/siphash.h"
 
 #include <string.h>
+#include <algorithm>
+#include <map>
+#include <deque>
+
+template<typename Policy>
+std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction_(const std::shared_ptr<std::vector<unsigned char> >& tx) {
+	std::lock_guard<std::mutex> lock(send_mutex);
+
+	if (send_tx_cache.contains(tx))
+		return std::shared_ptr<std::vector<unsigned char> >();
+
+	if (!Policy::may_cache(tx->size(), send_tx_cache.flagCount()))
+		return std::shared_ptr<std::vector<unsigned char> >();
+	send_tx_cache.add(tx, Policy::flag(tx->size()));
+	send_recent_txn.remove(tx->begin(), tx->end());
+
+	return tx_to_msg(tx);
+}
 
 std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx) {
-	std::lock_guard<std::mutex> lock(mutex);
+	if (useOldFlags)
+		return get_relay_transaction_<OldFlagsPolicy>(tx);
+	return get_relay_transaction_<SizeFlagsPolicy>(tx);
+}
+
+std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, uint64_t fee_per_kb,
+		std::shared_ptr<std::vector<unsigned char> >& evict_msg) {
+	assert(evicts_by_fee() && !useOldFlags);
+	std::lock_guard<std::mutex> lock(send_mutex);
+	evict_msg.reset();
 
 	if (send_tx_cache.contains(tx))
 		return std::shared_ptr<std::vector<unsigned char> >();
 
-	if (!useOldFlags) {
-		if (tx->size() > MAX_RELAY_TRANSACTION_BYTES)
-			return std::shared_ptr<std::vector<unsigned char> >();
-		send_tx_cache.add(tx, tx->size());
+	if (!SizeFlagsPolicy::may_cache(tx->size(), send_tx_cache.flagCount()))
+		return std::shared_ptr<std::vector<unsigned char> >();
+	uint32_t flag = SizeFlagsPolicy::flag(tx->size());
 
-	}
+	// Make room first, so that add() never evicts anything the peer wasn't told about
+	send_evicted.clear();
+	send_tx_cache.make_room(flag, send_evicted);
+	if (!send_evicted.empty())
+		evict_msg = evict_to_msg(send_evicted);
 
-	if (useOldFlags) {
-		if (tx->size() > OLD_MAX_RELAY_TRANSACTION_BYTES &&
-				(send_tx_cache.flagCount() >= OLD_MAX_EXTRA_OVERSIZE_TRANSACTIONS || tx->size() > OLD_MAX_RELAY_OVERSIZE_TRANSACTION_BYTES))
-			return std::shared_ptr<std::vector<unsigned char> >();
-		send_tx_cache.add(tx, tx->size() > OLD_MAX_RELAY_TRANSACTION_BYTES);
-	}
+	send_tx_cache.add(tx, flag, fee_per_kb);
 
+	int recent_index = send_recent_txn.remove(tx->begin(), tx->end());
+	if (recent_index >= 0)
+		return restore_to_msg(recent_index);
 	return tx_to_msg(tx);
 }
 
 void RelayNodeCompressor::reset() {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<std::mutex> send_lock(send_mutex);
+	std::lock_guard<std::mutex> recv_lock(recv_mutex);
 
 	recv_tx_cache.clear();
 	send_tx_cache.clear();
+	recv_recent_txn.clear();
+	send_recent_txn.clear();
+}
+
+void RelayNodeCompressor::reset_send() {
+	std::lock_guard<std::mutex> lock(send_mutex);
+	send_tx_cache.clear();
+	send_recent_txn.clear();
+}
+
+void RelayNodeCompressor::reset_recv() {
+	std::lock_guard<std::mutex> lock(recv_mutex);
+	recv_tx_cache.clear();
+	recv_recent_txn.clear();
+}
+
+template<typename Policy>
+bool RelayNodeCompressor::check_recv_tx_(uint32_t tx_size) {
+	return Policy::may_cache(tx_size, recv_tx_cache.flagCount());
 }
 
 bool RelayNodeCompressor::check_recv_tx(uint32_t tx_size) {
-	return (!useOldFlags && tx_size <= MAX_RELAY_TRANSACTION_BYTES) ||
-			(useOldFlags && (tx_size <= OLD_MAX_RELAY_TRANSACTION_BYTES || (recv_tx_cache.flagCount() < OLD_MAX_EXTRA_OVERSIZE_TRANSACTIONS && tx_size <= OLD_MAX_RELAY_OVERSIZE_TRANSACTION_BYTES)));
+	if (useOldFlags)
+		return check_recv_tx_<OldFlagsPolicy>(tx_size);
+	return check_recv_tx_<SizeFlagsPolicy>(tx_size);
 }
 
 bool RelayNodeCompressor::maybe_recv_tx_of_size(uint32_t tx_size, bool debug_print) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<std::mutex> lock(recv_mutex);
 
 	if (!check_recv_tx(tx_size)) {
 		if (debug_print)
@@ -50,34 +100,194 @@ bool RelayNodeCompressor::maybe_recv_tx_of_size(uint32_t tx_size, bool debug_pri
 	return true;
 }
 
+template<typename Policy>
+void RelayNodeCompressor::recv_tx_(const std::shared_ptr<std::vector<unsigned char> >& tx) {
+	uint32_t tx_size = tx->size();
+	assert(check_recv_tx_<Policy>(tx_size));
+	recv_tx_cache.add(tx, Policy::flag(tx_size));
+	recv_recent_txn.remove(tx->begin(), tx->end());
+}
+
 void RelayNodeCompressor::recv_tx(std::shared_ptr<std::vector<unsigned char > > tx) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<std::mutex> lock(recv_mutex);
+	if (useOldFlags)
+		recv_tx_<OldFlagsPolicy>(tx);
+	else
+		recv_tx_<SizeFlagsPolicy>(tx);
+}
+
+void RelayNodeCompressor::recv_recent_tx(const std::shared_ptr<std::vector<unsigned char> >& tx) {
+	std::lock_guard<std::mutex> lock(recv_mutex);
+	recv_recent_txn.add(tx, SizeFlagsPolicy::flag(tx->size()));
+}
+
+template<typename Policy>
+const char* RelayNodeCompressor::recv_restore_(const std::vector<unsigned char>& data, std::shared_ptr<std::vector<unsigned char> >& tx) {
+	unsigned char txid[32];
+	if (data.size() != 2 || !recv_recent_txn.remove((data[0] << 8) | data[1], tx, txid))
+		return "RESTORE_INDEX_INVALID";
+	if (!check_recv_tx_<Policy>(tx->size()))
+		return "RESTORE_TX_TOO_LARGE";
+	recv_tx_cache.add(tx, Policy::flag(tx->size()));
+	return NULL;
+}
+
+const char* RelayNodeCompressor::recv_restore(const std::vector<unsigned char>& data, std::shared_ptr<std::vector<unsigned char> >& tx) {
+	std::lock_guard<std::mutex> lock(recv_mutex);
+	if (useOldFlags)
+		return recv_restore_<OldFlagsPolicy>(data, tx);
+	return recv_restore_<SizeFlagsPolicy>(data, tx);
+}
+
+void RelayNodeCompressor::add_recent(FlaggedArraySet& recent, std::vector<std::shared_ptr<std::vector<unsigned char> > >& removed) {
+	for (const std::shared_ptr<std::vector<unsigned char> >& tx : removed)
+		recent.add(tx, SizeFlagsPolicy::flag(tx->size()));
+	removed.clear();
+}
 
-	uint32_t tx_size = tx.get()->size();
-	assert(check_recv_tx(tx_size));
-	recv_tx_cache.add(tx, useOldFlags ? tx_size > OLD_MAX_RELAY_TRANSACTION_BYTES : tx_size);
+const char* RelayNodeCompressor::recv_evict(const std::vector<unsigned char>& indexes) {
+	std::lock_guard<std::mutex> lock(recv_mutex);
+
+	if (indexes.size() % 2)
+		return "INVALID_EVICT_SIZE";
+
+	std::shared_ptr<std::vector<unsigned char> > elem;
+	unsigned char elemHash[32];
+	for (size_t i = 0; i < indexes.size(); i += 2) {
+		if (!recv_tx_cache.remove((indexes[i] << 8) | indexes[i + 1], elem, elemHash))
+			return "EVICT_INDEX_INVALID";
+	}
+	return NULL;
 }
 
 void RelayNodeCompressor::for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<std::mutex> lock(send_mutex);
 	send_tx_cache.for_all_txn(callback);
 }
 
+void RelayNodeCompressor::for_each_recent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) {
+	std::lock_guard<std::mutex> lock(send_mutex);
+	send_recent_txn.for_all_txn(callback);
+}
+
 bool RelayNodeCompressor::block_sent(std::vector<unsigned char>& hash) {
-	std::lock_guard<std::mutex> lock(mutex);
-	return blocksAlreadySeen.insert(hash).second;
+	std::lock_guard<std::mutex> lock(seen_mutex);
+	return blocksAlreadySeen.insert(hash);
+}
+
+void RelayNodeCompressor::block_mined(const BlockView& block) {
+	std::lock_guard<std::mutex> lock(send_mutex);
+	{
+		std::lock_guard<std::mutex> seen_lock(seen_mutex);
+		if (!blocksAlreadySeen.insert(block.get_hash()))
+			return;
+	}
+
+	if (useTxCoding) {
+		// Same as a BlockCompressionStream would leave things, including send_recent_txn
+		for (uint32_t i = 0; i < block.tx_count(); i++) {
+			int pos = send_tx_cache.index_of(block.tx_begin(i), block.tx_end(i));
+			if (pos >= 0)
+				send_positions.push_back(pos);
+		}
+		std::sort(send_positions.begin(), send_positions.end());
+		send_positions.erase(std::unique(send_positions.begin(), send_positions.end()), send_positions.end());
+		send_tx_cache.remove_sorted(send_positions, &send_removed);
+		add_recent(send_recent_txn, send_removed);
+		send_positions.clear();
+	} else {
+		send_batch.clear();
+		for (uint32_t i = 0; i < block.tx_count(); i++)
+			send_batch.emplace_back(block.tx_begin(i), block.tx_end(i));
+		send_tx_cache.remove_batch(send_batch, send_batch_indexes);
+	}
 }
 
 uint32_t RelayNodeCompressor::blocks_sent() {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<std::mutex> lock(seen_mutex);
 	return blocksAlreadySeen.size();
 }
 
 bool RelayNodeCompressor::was_tx_sent(const unsigned char* txhash) {
-	std::lock_guard<std::mutex> lock(mutex);
+	// Doesn't need to wait for a block being compressed to finish
 	return send_tx_cache.contains(txhash);
 }
 
+CompressionStats RelayNodeCompressor::get_send_stats() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	return send_stats;
+}
+
+CompressionStats RelayNodeCompressor::get_recv_stats() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	return recv_stats;
+}
+
+uint64_t Histogram::percentile(double fraction) const {
+	uint64_t seen = 0;
+	for (int i = 0; i < 65; i++) {
+		seen += buckets[i];
+		if (seen && seen >= fraction * count)
+			return i == 0 ? 0 : std::min(max, i == 64 ? uint64_t(-1) : (uint64_t(1) << i) - 1);
+	}
+	return 0;
+}
+
+void CompressionStats::add(const BlockCompressionStats& block) {
+	blocks++;
+	txn += block.txn;
+	misses += block.misses;
+	block_bytes += block.block_bytes;
+	wire_bytes += block.wire_bytes;
+
+	miss_percent.add(block.txn ? uint64_t(block.misses) * 100 / block.txn : 0);
+	miss_count.add(block.misses);
+	miss_bytes.add(block.miss_bytes);
+	bytes_saved.add(block.block_bytes > block.wire_bytes ? block.block_bytes - block.wire_bytes : 0);
+	cache_txn.add(block.cache_txn);
+	cache_evictions.add(block.cache_evictions);
+	micros.add(std::chrono::duration_cast<std::chrono::microseconds>(block.time).count());
+	last = block;
+}
+
+void CompressionStats::print(const char* name) const {
+	printf("%s STATS %lu blocks, %lu of %lu txn missed (%lf%%), %lu bytes in %lu on the wire\n", name,
+			(unsigned long)blocks, (unsigned long)misses, (unsigned long)txn, txn ? double(misses) * 100 / txn : 0.0,
+			(unsigned long)block_bytes, (unsigned long)wire_bytes);
+	if (!blocks)
+		return;
+	printf("%s STATS per block (p50/p90/max): misses %lu/%lu/%lu miss bytes %lu/%lu/%lu cache txn %lu/%lu/%lu evictions %lu/%lu/%lu us %lu/%lu/%lu\n", name,
+			(unsigned long)miss_count.percentile(0.5), (unsigned long)miss_count.percentile(0.9), (unsigned long)miss_count.max,
+			(unsigned long)miss_bytes.percentile(0.5), (unsigned long)miss_bytes.percentile(0.9), (unsigned long)miss_bytes.max,
+			(unsigned long)cache_txn.percentile(0.5), (unsigned long)cache_txn.percentile(0.9), (unsigned long)cache_txn.max,
+			(unsigned long)cache_evictions.percentile(0.5), (unsigned long)cache_evictions.percentile(0.9), (unsigned long)cache_evictions.max,
+			(unsigned long)micros.percentile(0.5), (unsigned long)micros.percentile(0.9), (unsigned long)micros.max);
+}
+
+// Short ids are the low 48 bits of SipHash(txid), keyed by the hash of the block they're in so that
+// collisions can't be set up ahead of time and differ from block to block
+static void short_id_keys(const std::vector<unsigned char>& blockhash, uint64_t& k0, uint64_t& k1) {
+	memcpy(&k0, &blockhash[0], 8);
+	memcpy(&k1, &blockhash[8], 8);
+	k0 = le64toh(k0);
+	k1 = le64toh(k1);
+}
+
+#ifdef TEST_DATA
+uint64_t short_id_mask = 0xffffffffffffULL;
+#else
+static const uint64_t short_id_mask = 0xffffffffffffULL;
+#endif
+
+static inline uint64_t short_txid(uint64_t k0, uint64_t k1, const unsigned char* txid) {
+	return SipHashUint256(k0, k1, txid) & short_id_mask;
+}
+
+static inline void write_short_id(std::vector<unsigned char>& out, uint64_t short_id) {
+	for (int i = 5; i >= 0; i--)
+		out.push_back((short_id >> (8 * i)) & 0xff);
+}
+
 class MerkleTreeBuilder {
 private:
 	std::vector<unsigned char> hashlist;
@@ -102,136 +312,471 @@ public:
 	}
 };
 
-std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeCompressor::maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle) {
-	std::lock_guard<std::mutex> lock(mutex);
-	FASLockHint faslock(send_tx_cache);
+#define MAX_CHECKED_BLOCKS 16
 
-	if (check_merkle && (hash[31] != 0 || hash[30] != 0 || hash[29] != 0 || hash[28] != 0 || hash[27] != 0 || hash[26] != 0 || hash[25] != 0))
-		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "BAD_WORK");
+static std::mutex checked_blocks_mutex;
+static std::map<std::vector<unsigned char>, std::shared_ptr<const std::vector<unsigned char> > > checked_blocks;
+static std::deque<std::vector<unsigned char> > checked_blocks_order;
 
-	if (blocksAlreadySeen.count(hash))
-		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "SEEN");
+bool check_merkle_once(const std::vector<unsigned char>& hash, const unsigned char* merkle_root, const unsigned char* txids, uint32_t txcount) {
+	if (!txcount)
+		return false;
 
-	auto compressed_block = std::make_shared<std::vector<unsigned char> >();
-	compressed_block->reserve(1100000);
-	struct relay_msg_header header;
+	std::shared_ptr<const std::vector<unsigned char> > known;
+	{
+		std::lock_guard<std::mutex> lock(checked_blocks_mutex);
+		auto it = checked_blocks.find(hash);
+		if (it != checked_blocks.end())
+			known = it->second;
+	}
+
+	// The block hash commits to the merkle root, so the same txids are known to match it
+	if (known && known->size() == 32 * size_t(txcount) && !memcmp(&(*known)[0], txids, 32 * size_t(txcount)))
+		return true;
+
+	MerkleTreeBuilder merkleTree(txcount);
+	memcpy(merkleTree.getTxHashLoc(0), txids, 32 * size_t(txcount));
+	if (!merkleTree.merkleRootMatches(merkle_root))
+		return false;
+
+	auto checked = std::make_shared<const std::vector<unsigned char> >(txids, txids + 32 * size_t(txcount));
+	std::lock_guard<std::mutex> lock(checked_blocks_mutex);
+	auto it = checked_blocks.find(hash);
+	if (it != checked_blocks.end())
+		it->second = checked;
+	else {
+		checked_blocks[hash] = checked;
+		checked_blocks_order.push_back(hash);
+		if (checked_blocks_order.size() > MAX_CHECKED_BLOCKS) {
+			checked_blocks.erase(checked_blocks_order.front());
+			checked_blocks_order.pop_front();
+		}
+	}
+	return true;
+}
+
+std::shared_ptr<const std::vector<unsigned char> > get_checked_txids(const std::vector<unsigned char>& hash) {
+	std::lock_guard<std::mutex> lock(checked_blocks_mutex);
+	auto it = checked_blocks.find(hash);
+	if (it == checked_blocks.end())
+		return std::shared_ptr<const std::vector<unsigned char> >();
+	return it->second;
+}
+
+BlockCompressionStream::BlockCompressionStream(RelayNodeCompressor& compressorIn, bool check_work_in, bool check_merkle_in) :
+	compressor(compressorIn), lock(compressor.send_mutex),
+	check_work(check_work_in), check_merkle(check_merkle_in), txcount(0), txn_done(0), run_start(0), run_count(0), run_first_tx(0), started(false), finished(false) {
+	// A bad merkle root is only found at the end, when the block can only be aborted
+	assert(!check_merkle || compressor.useShortIds);
+}
+
+const char* BlockCompressionStream::start(const unsigned char* header, const std::vector<unsigned char>& hashIn, uint32_t tx_count, std::vector<unsigned char>& out) {
+	assert(!started && hashIn.size() == 32);
+	hash = hashIn;
+	start_time = std::chrono::steady_clock::now();
+
+	if (check_work && (hash[31] != 0 || hash[30] != 0 || hash[29] != 0 || hash[28] != 0 || hash[27] != 0 || hash[26] != 0 || hash[25] != 0))
+		return "BAD_WORK";
+
+	{
+		std::lock_guard<std::mutex> seen_lock(compressor.seen_mutex);
+		if (compressor.blocksAlreadySeen.count(hash))
+			return "SEEN";
+	}
 
-	try {
-		std::vector<unsigned char>::const_iterator readit = block.begin();
-		move_forward(readit, sizeof(struct bitcoin_msg_header), block.end());
-		move_forward(readit, 4, block.end());
 #ifndef TEST_DATA
-		int32_t block_version = ((*(readit-1) << 24) | (*(readit-2) << 16) | (*(readit-3) << 8) | *(readit-4));
-		if (block_version < 4)
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "SMALL_VERSION");
+	int32_t block_version = ((header[3] << 24) | (header[2] << 16) | (header[1] << 8) | header[0]);
+	if (block_version < 4)
+		return "SMALL_VERSION";
 #endif
 
-		move_forward(readit, 32, block.end());
-		auto merkle_hash_it = readit;
-		move_forward(readit, 80 - (4 + 32), block.end());
+	if (tx_count < 1 || tx_count > 100000)
+		return "TXCOUNT_RANGE";
+
+	txcount = tx_count;
+	merkle_root.assign(header + 4 + 32, header + 4 + 32 + 32);
+	if (check_merkle || compressor.useTxCoding)
+		txids.resize(32 * txcount);
+	if (compressor.useTxCoding) {
+		compressor.send_block_txids.clear();
+		compressor.send_positions.clear();
+		compressor.send_used.assign(compressor.send_tx_cache.size(), false);
+	}
 
-		uint64_t txcount = read_varint(readit, block.end());
-		if (txcount < 1 || txcount > 100000)
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "TXCOUNT_RANGE");
+	if (compressor.useShortIds) {
+		short_id_keys(hash, short_id_k0, short_id_k1);
+		std::vector<uint64_t>& short_ids = compressor.send_short_ids;
+		short_ids.clear();
+		compressor.send_tx_cache.for_all_hashes([&](uint32_t, const unsigned char* txid) {
+			short_ids.push_back(short_txid(short_id_k0, short_id_k1, txid));
+		});
+		if (compressor.useTxCoding)
+			compressor.send_recent_txn.for_all_hashes([&](uint32_t, const unsigned char* txid) {
+				short_ids.push_back(short_txid(short_id_k0, short_id_k1, txid));
+			});
+		std::sort(short_ids.begin(), short_ids.end());
+	}
 
-		header.magic = RELAY_MAGIC_BYTES;
-		header.type = BLOCK_TYPE;
-		header.length = htonl(txcount);
-		compressed_block->insert(compressed_block->end(), (unsigned char*)&header, ((unsigned char*)&header) + sizeof(header));
-		compressed_block->insert(compressed_block->end(), block.begin() + sizeof(struct bitcoin_msg_header), block.begin() + 80 + sizeof(struct bitcoin_msg_header));
+	stats.txn = txcount;
+	stats.block_bytes = 80 + varint(txcount).size();
+	stats.cache_txn = compressor.send_tx_cache.size();
+	stats.cache_evictions = compressor.send_tx_cache.evictedCount() - compressor.send_evictions_seen;
+	out_start = out.size();
+
+	struct relay_msg_header relay_header;
+	relay_header.magic = RELAY_MAGIC_BYTES;
+	relay_header.type = compressor.BLOCK_TYPE;
+	relay_header.length = htonl(txcount);
+	out.insert(out.end(), (unsigned char*)&relay_header, ((unsigned char*)&relay_header) + sizeof(relay_header));
+	out.insert(out.end(), header, header + 80);
+
+	started = true;
+	return NULL;
+}
 
-		MerkleTreeBuilder merkleTree(check_merkle ? txcount : 0);
+void BlockCompressionStream::write_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, std::vector<unsigned char>& out) {
+	if (compressor.useTxCoding) {
+		// Cached txn are left in place until the block is done (as the receiver does), so that
+		// positions, and thus runs, are relative to the cache as it was when the block started
+		int pos = compressor.send_tx_cache.index_of(begin, end);
+		if (pos >= 0 && compressor.send_used[pos])
+			pos = -1;
+
+		if (pos < 0) {
+			flush_run(out);
+			// A tx from a block which was just mined (ie this one's competitor) is left in the recent cache
+			const unsigned char* txid = &txids[32 * (txn_done - 1)];
+			if (compressor.send_recent_txn.contains(txid)) {
+				uint64_t short_id = short_txid(short_id_k0, short_id_k1, txid);
+				auto range = std::equal_range(compressor.send_short_ids.begin(), compressor.send_short_ids.end(), short_id);
+				if (short_id < RELAY_SHORT_ID_RUN && range.second - range.first == 1) {
+					write_short_id(out, short_id);
+					return;
+				}
+			}
+			write_short_id(out, RELAY_SHORT_ID_INLINE);
+			write_inline(begin, end, txn_done - 1, out);
+			return;
+		}
 
-		for (uint32_t i = 0; i < txcount; i++) {
-			std::vector<unsigned char>::const_iterator txstart = readit;
+		compressor.send_used[pos] = true;
+		compressor.send_positions.push_back(pos);
+		if (run_count && uint32_t(pos) == run_start + run_count && run_count < 0xffff)
+			run_count++;
+		else {
+			flush_run(out);
+			run_start = pos;
+			run_count = 1;
+			run_first_tx = txn_done - 1;
+		}
+		return;
+	}
 
-			move_forward(readit, 4, block.end());
+	unsigned char txid[32];
+	int index = compressor.send_tx_cache.remove(begin, end, compressor.useShortIds ? txid : NULL);
+	write_removed_tx(begin, end, index, txid, out);
+}
 
-			uint64_t txins = read_varint(readit, block.end());
-			for (uint64_t j = 0; j < txins; j++) {
-				move_forward(readit, 36, block.end());
-				move_forward(readit, read_varint(readit, block.end()) + 4, block.end());
-			}
+void BlockCompressionStream::write_removed_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, int index, const unsigned char* txid, std::vector<unsigned char>& out) {
+	bool send_inline;
+	if (compressor.useShortIds) {
+		uint64_t short_id = index < 0 ? RELAY_SHORT_ID_INLINE : short_txid(short_id_k0, short_id_k1, txid);
 
-			uint64_t txouts = read_varint(readit, block.end());
-			for (uint64_t j = 0; j < txouts; j++) {
-				move_forward(readit, 8, block.end());
-				move_forward(readit, read_varint(readit, block.end()), block.end());
-			}
+		// Anything the receiver couldn't resolve unambiguously goes in full (it will still drop it from its cache)
+		if (short_id < RELAY_SHORT_ID_ABORT) {
+			auto range = std::equal_range(compressor.send_short_ids.begin(), compressor.send_short_ids.end(), short_id);
+			if (range.second - range.first != 1)
+				short_id = RELAY_SHORT_ID_INLINE;
+		} else
+			short_id = RELAY_SHORT_ID_INLINE;
+
+		write_short_id(out, short_id);
+		send_inline = short_id == RELAY_SHORT_ID_INLINE;
+	} else {
+		if (index < 0) {
+			out.push_back(0xff);
+			out.push_back(0xff);
+		} else {
+			out.push_back((index >> 8) & 0xff);
+			out.push_back((index     ) & 0xff);
+		}
+		send_inline = index < 0;
+	}
 
-			move_forward(readit, 4, block.end());
+	if (send_inline)
+		write_inline(begin, end, txn_done - 1, out);
+}
 
-			int index = send_tx_cache.remove(txstart, readit);
+void BlockCompressionStream::write_inline(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, uint32_t tx_index, std::vector<unsigned char>& out) {
+	uint32_t txlen = end - begin;
+	size_t len_pos = out.size();
+	out.resize(len_pos + 3);
+	stats.misses++;
+	stats.miss_bytes += txlen;
+
+	if (compressor.useTxCoding && encode_tx(begin, end, out, [&](const unsigned char* txid, uint64_t& ref) { return prevout_ref(txid, tx_index, ref); })) {
+		if (out.size() - len_pos - 3 < txlen)
+			txlen = (out.size() - len_pos - 3) | RELAY_TX_CODED_FLAG;
+		else
+			out.resize(len_pos + 3);
+	}
 
-			__builtin_prefetch(&(*readit), 0);
-			__builtin_prefetch(&(*readit) + 64, 0);
-			__builtin_prefetch(&(*readit) + 128, 0);
-			__builtin_prefetch(&(*readit) + 196, 0);
-			__builtin_prefetch(&(*readit) + 256, 0);
+	out[len_pos    ] = (txlen >> 16) & 0xff;
+	out[len_pos + 1] = (txlen >>  8) & 0xff;
+	out[len_pos + 2] = (txlen      ) & 0xff;
 
-			if (check_merkle)
-				double_sha256(&(*txstart), merkleTree.getTxHashLoc(i), readit - txstart);
+	if (!(txlen & RELAY_TX_CODED_FLAG))
+		out.insert(out.end(), begin, end);
+}
 
-			if (index < 0) {
-				compressed_block->push_back(0xff);
-				compressed_block->push_back(0xff);
+// Runs shorter than this are cheaper as separate short ids
+#define MIN_RUN_LENGTH 3
 
-				uint32_t txlen = readit - txstart;
-				compressed_block->push_back((txlen >> 16) & 0xff);
-				compressed_block->push_back((txlen >>  8) & 0xff);
-				compressed_block->push_back((txlen      ) & 0xff);
+void BlockCompressionStream::flush_run(std::vector<unsigned char>& out) {
+	if (!run_count)
+		return;
 
-				compressed_block->insert(compressed_block->end(), txstart, readit);
-			} else {
-				compressed_block->push_back((index >> 8) & 0xff);
-				compressed_block->push_back((index     ) & 0xff);
+	std::shared_ptr<std::vector<unsigned char> > tx;
+	unsigned char txid[32];
+	if (run_count >= MIN_RUN_LENGTH) {
+		uint64_t check = 0;
+		for (uint32_t i = 0; i < run_count; i++) {
+			compressor.send_tx_cache.get(run_start + i, tx, txid);
+			check += short_txid(short_id_k0, short_id_k1, txid) * (i + 1);
+		}
+
+		assert(run_start + run_count <= 0xffff);
+		write_short_id(out, RELAY_SHORT_ID_RUN);
+		out.push_back((run_start >> 8) & 0xff);
+		out.push_back((run_start     ) & 0xff);
+		out.push_back((run_count >> 8) & 0xff);
+		out.push_back((run_count     ) & 0xff);
+		write_short_id(out, check & 0xffffffffffffULL);
+	} else {
+		for (uint32_t i = 0; i < run_count; i++) {
+			compressor.send_tx_cache.get(run_start + i, tx, txid);
+			uint64_t short_id = short_txid(short_id_k0, short_id_k1, txid);
+			auto range = std::equal_range(compressor.send_short_ids.begin(), compressor.send_short_ids.end(), short_id);
+			if (short_id < RELAY_SHORT_ID_RUN && range.second - range.first == 1)
+				write_short_id(out, short_id);
+			else {
+				write_short_id(out, RELAY_SHORT_ID_INLINE);
+				write_inline(tx->begin(), tx->end(), run_first_tx + i, out);
 			}
 		}
+	}
+	run_count = 0;
+}
+
+void BlockCompressionStream::remove_sent() {
+	std::vector<uint32_t>& positions = compressor.send_positions;
+	if (positions.empty())
+		return;
+	std::sort(positions.begin(), positions.end());
+	compressor.send_tx_cache.remove_sorted(positions, &compressor.send_removed);
+	compressor.add_recent(compressor.send_recent_txn, compressor.send_removed);
+	positions.clear();
+}
+
+BlockCompressionStream::~BlockCompressionStream() {
+	remove_sent();
+}
+
+// Earlier txn in this block are referred to by index and anything the receiver has cached by short
+// id, as long as it is unambiguous (the receiver's table is built before any removals, like ours)
+int BlockCompressionStream::prevout_ref(const unsigned char* txid, uint32_t tx_index, uint64_t& ref) {
+	uint64_t key;
+	memcpy(&key, txid, 8);
+	auto it = compressor.send_block_txids.find(key);
+	if (it != compressor.send_block_txids.end() && it->second < tx_index && !memcmp(&txids[32 * it->second], txid, 32)) {
+		ref = it->second;
+		return TX_PREVOUT_BLOCK_TX;
+	}
+
+	if (compressor.send_tx_cache.contains(txid) || compressor.send_recent_txn.contains(txid)) {
+		uint64_t short_id = short_txid(short_id_k0, short_id_k1, txid);
+		auto range = std::equal_range(compressor.send_short_ids.begin(), compressor.send_short_ids.end(), short_id);
+		if (short_id < RELAY_SHORT_ID_ABORT && range.second - range.first == 1) {
+			ref = short_id;
+			return TX_PREVOUT_SHORT_ID;
+		}
+	}
+	return TX_PREVOUT_TXID;
+}
+
+void BlockCompressionStream::add_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, std::vector<unsigned char>& out, const unsigned char* txid) {
+	assert(started && !finished && txn_done < txcount);
+	stats.block_bytes += end - begin;
 
-		if (check_merkle && !merkleTree.merkleRootMatches(&(*merkle_hash_it)))
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_MERKLE");
-	} catch(read_exception) {
-		return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_SIZE");
+	if (check_merkle || compressor.useTxCoding) {
+		if (txid)
+			memcpy(&txids[32 * txn_done], txid, 32);
+		else
+			double_sha256(&(*begin), &txids[32 * txn_done], end - begin);
+	}
+	if (compressor.useTxCoding) {
+		uint64_t key;
+		memcpy(&key, &txids[32 * txn_done], 8);
+		compressor.send_block_txids[key] = txn_done;
 	}
 
-	if (!blocksAlreadySeen.insert(hash).second)
-		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "MUTEX_BROKEN???");
+	if (++txn_done == txcount) {
+		last_tx_begin = begin;
+		last_tx_end = end;
+	} else
+		write_tx(begin, end, out);
+}
 
-	return std::make_tuple(compressed_block, (const char*)NULL);
+void BlockCompressionStream::add_block_txn(const BlockView& block, std::vector<unsigned char>& out) {
+	assert(started && !finished && txn_done == 0 && block.tx_count() == txcount);
+	assert(!check_merkle && !compressor.useTxCoding);
+
+	auto& batch = compressor.send_batch;
+	batch.clear();
+	for (uint32_t i = 0; i + 1 < txcount; i++) {
+		batch.emplace_back(block.tx_begin(i), block.tx_end(i));
+		stats.block_bytes += block.tx(i).length;
+	}
+	if (compressor.useShortIds)
+		compressor.send_batch_txids.resize(32 * batch.size());
+	compressor.send_tx_cache.remove_batch(batch, compressor.send_batch_indexes,
+			compressor.useShortIds ? compressor.send_batch_txids.data() : NULL);
+
+	for (uint32_t i = 0; i < batch.size(); i++) {
+		txn_done++;
+		write_removed_tx(batch[i].first, batch[i].second, compressor.send_batch_indexes[i],
+				compressor.useShortIds ? &compressor.send_batch_txids[32 * i] : NULL, out);
+	}
 }
 
-struct IndexVector {
-	uint16_t index;
-	std::vector<unsigned char> data;
-};
-struct IndexPtr {
-	uint16_t index;
-	size_t pos;
-	IndexPtr(uint16_t index_in, size_t pos_in) : index(index_in), pos(pos_in) {}
-	bool operator< (const IndexPtr& o) const { return index < o.index; }
-};
+const char* BlockCompressionStream::finish(std::vector<unsigned char>& out) {
+	assert(started && !finished && txn_done == txcount);
+
+	if (check_merkle && !check_merkle_once(hash, &merkle_root[0], &txids[0], txcount)) {
+		abort(out);
+		return "INVALID_MERKLE";
+	}
 
-void tweak_sort(std::vector<IndexPtr>& ptrs, size_t start, size_t end) {
-	if (start + 1 >= end)
+	write_tx(last_tx_begin, last_tx_end, out);
+	flush_run(out);
+	remove_sent();
+	finished = true;
+
+	stats.wire_bytes = out.size() - out_start;
+	stats.time = std::chrono::steady_clock::now() - start_time;
+	compressor.send_evictions_seen = compressor.send_tx_cache.evictedCount();
+	{
+		std::lock_guard<std::mutex> stats_lock(compressor.stats_mutex);
+		compressor.send_stats.add(stats);
+	}
+
+	// block_sent() may have marked it while it was being compressed, as it only takes seen_mutex
+	std::lock_guard<std::mutex> seen_lock(compressor.seen_mutex);
+	compressor.blocksAlreadySeen.insert(hash);
+	return NULL;
+}
+
+void BlockCompressionStream::abort(std::vector<unsigned char>& out) {
+	assert(started);
+	if (finished)
 		return;
-	size_t split = (end - start) / 2 + start;
-	tweak_sort(ptrs, start, split);
-	tweak_sort(ptrs, split, end);
-
-	size_t j = 0, k = split;
-	std::vector<IndexPtr> left(ptrs.begin() + start, ptrs.begin() + split);
-	for (size_t i = start; i < end; i++) {
-		if (j < left.size() && (k >= end || left[j].index - (k - split) <= ptrs[k].index)) {
-			ptrs[i] = left[j++];
-			ptrs[i].index -= (k - split);
-		} else
-			ptrs[i] = ptrs[k++];
+
+	assert(compressor.useShortIds);
+	flush_run(out);
+	write_short_id(out, RELAY_SHORT_ID_ABORT);
+	remove_sent();
+	finished = true;
+}
+
+std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeCompressor::maybe_compress_block(const BlockView& block, bool check_merkle) {
+	auto compressed_block = std::make_shared<std::vector<unsigned char> >();
+	compressed_block->reserve(1100000);
+
+	// The whole block is here, so check the merkle root before touching send_tx_cache instead of
+	// letting the stream do it at the end, that way a bad block never needs to be aborted
+	BlockCompressionStream stream(*this, check_merkle, false);
+	const char* err = stream.start(block.header(), block.get_hash(), block.tx_count(), *compressed_block);
+	if (err)
+		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), err);
+
+	if (block.error())
+		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), block.error());
+
+	uint32_t txcount = block.tx_count();
+
+	// A block we are checking has to be hashed anyway, otherwise one which has been checked already
+	// (ie which we just decompressed) doesn't need to be hashed again for tx coding
+	const unsigned char* txids = NULL;
+	std::shared_ptr<const std::vector<unsigned char> > checked_txids;
+	if (check_merkle) {
+		txids = block.txid(0);
+		if (!check_merkle_once(block.get_hash(), block.merkle_root(), txids, txcount))
+			return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "INVALID_MERKLE");
+	} else if (useTxCoding) {
+		checked_txids = get_checked_txids(block.get_hash());
+		if (checked_txids && checked_txids->size() == 32 * size_t(txcount))
+			txids = &(*checked_txids)[0];
+		else
+			txids = block.txid(0);
+	}
+
+	// Without tx coding the whole block can be looked up in one batch, the last tx is still added
+	// on its own as the stream holds it back until finish()
+	uint32_t i = 0;
+	if (!useTxCoding) {
+		stream.add_block_txn(block, *compressed_block);
+		i = txcount - 1;
+	}
+	for (; i < txcount; i++) {
+		stream.add_tx(block.tx_begin(i), block.tx_end(i), *compressed_block, useTxCoding ? txids + 32 * i : NULL);
+
+		if (i + 1 < txcount) {
+			const unsigned char* next = &(*block.tx_begin(i + 1));
+			__builtin_prefetch(next, 0);
+			__builtin_prefetch(next + 64, 0);
+			__builtin_prefetch(next + 128, 0);
+			__builtin_prefetch(next + 196, 0);
+			__builtin_prefetch(next + 256, 0);
+		}
 	}
+
+	err = stream.finish(*compressed_block);
+	if (err)
+		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), err);
+
+	return std::make_tuple(compressed_block, (const char*)NULL);
+}
+
+// Indexes on the wire are positions in the cache after every previously-referenced tx has been
+// removed. We resolve them to absolute positions with a Fenwick tree over the cache, which holds a 1
+// for each position still present, so finding the index'th remaining position is a log(n) descent.
+static void index_tree_init(std::vector<uint32_t>& tree, size_t size) {
+	tree.resize(size + 1);
+	for (size_t i = 1; i <= size; i++)
+		tree[i] = i & -i;
+}
+
+static uint32_t index_tree_take(std::vector<uint32_t>& tree, uint32_t index) {
+	size_t size = tree.size() - 1, pos = 0, step = 1;
+	while (step * 2 <= size)
+		step *= 2;
+
+	uint32_t remaining = index + 1;
+	for (; step; step /= 2) {
+		if (pos + step <= size && tree[pos + step] < remaining) {
+			pos += step;
+			remaining -= tree[pos];
+		}
+	}
+
+	for (size_t i = pos + 1; i <= size; i += i & -i)
+		tree[i]--;
+	return pos;
 }
 
 std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle) {
-	std::lock_guard<std::mutex> lock(mutex);
-	FASLockHint faslock(recv_tx_cache);
+	std::lock_guard<std::mutex> lock(recv_mutex);
+	std::chrono::steady_clock::time_point start_time(std::chrono::steady_clock::now());
 
 	if (message_size > 100000)
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got a BLOCK message with far too many transactions", std::shared_ptr<std::vector<unsigned char> >(NULL));
@@ -252,7 +797,10 @@ std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*,
 
 	auto fullhashptr = std::make_shared<std::vector<unsigned char> > (32);
 	getblockhash(*fullhashptr.get(), *block, sizeof(struct bitcoin_msg_header));
-	blocksAlreadySeen.insert(*fullhashptr.get());
+	{
+		std::lock_guard<std::mutex> seen_lock(seen_mutex);
+		blocksAlreadySeen.insert(*fullhashptr.get());
+	}
 
 	if (check_merkle && ((*fullhashptr)[31] != 0 || (*fullhashptr)[30] != 0 || (*fullhashptr)[29] != 0 || (*fullhashptr)[28] != 0 || (*fullhashptr)[27] != 0 || (*fullhashptr)[26] != 0 || (*fullhashptr)[25] != 0))
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "block hash did not meet minimum difficulty target", std::shared_ptr<std::vector<unsigned char> >(NULL));
@@ -262,19 +810,127 @@ std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*,
 
 	MerkleTreeBuilder merkleTree(check_merkle ? message_size : 1);
 
-	std::vector<IndexVector> txn_data(message_size);
-	std::vector<IndexPtr> txn_ptrs;
-	txn_ptrs.reserve(message_size);
+	// The P2P message checksum is hashed as the block is rebuilt, so the block can go out to bitcoind
+	// as soon as the last tx is in without another pass over it
+	uint32_t msg_hash[8];
+	double_sha256_init(msg_hash);
+	size_t msg_hashed = sizeof(bitcoin_msg_header);
+
+	uint32_t cache_size = recv_tx_cache.size();
+	recv_positions.clear();
+
+	BlockCompressionStats stats;
+	stats.txn = message_size;
+	stats.cache_txn = cache_size;
+	stats.cache_evictions = recv_tx_cache.evictedCount() - recv_evictions_seen;
+
+	uint64_t short_id_k0, short_id_k1;
+	if (useShortIds) {
+		short_id_keys(*fullhashptr, short_id_k0, short_id_k1);
+		recv_short_ids.clear();
+		recv_tx_cache.for_all_hashes([&](uint32_t pos, const unsigned char* txid) {
+			recv_short_ids.emplace_back(short_txid(short_id_k0, short_id_k1, txid), pos);
+		});
+		// Recent txn are at cache_size onwards
+		if (useTxCoding)
+			recv_recent_txn.for_all_hashes([&](uint32_t pos, const unsigned char* txid) {
+				recv_short_ids.emplace_back(short_txid(short_id_k0, short_id_k1, txid), cache_size + pos);
+			});
+		std::sort(recv_short_ids.begin(), recv_short_ids.end());
+	} else
+		index_tree_init(recv_index_tree, cache_size);
+
+	// Coded txn may refer to earlier txn in the block, whose txids we only work out if asked for
+	if (useTxCoding) {
+		recv_tx_offsets.clear();
+		if (!check_merkle) {
+			recv_txids.resize(32 * message_size);
+			recv_txid_known.assign(message_size, false);
+		}
+	}
+	tx_prevout_resolve resolve_prevout = [&](int kind, uint64_t ref, unsigned char* txid) {
+		if (kind == TX_PREVOUT_BLOCK_TX) {
+			if (ref >= recv_tx_offsets.size() - 1)
+				return false;
+			if (check_merkle)
+				memcpy(txid, merkleTree.getTxHashLoc(ref), 32);
+			else {
+				if (!recv_txid_known[ref]) {
+					double_sha256(&(*block)[recv_tx_offsets[ref]], &recv_txids[32 * ref], recv_tx_offsets[ref + 1] - recv_tx_offsets[ref]);
+					recv_txid_known[ref] = true;
+				}
+				memcpy(txid, &recv_txids[32 * ref], 32);
+			}
+			return true;
+		}
+
+		auto it = std::lower_bound(recv_short_ids.begin(), recv_short_ids.end(), std::make_pair(ref, uint32_t(0)));
+		if (it == recv_short_ids.end() || it->first != ref || (it + 1 != recv_short_ids.end() && (it + 1)->first == ref))
+			return false;
+		std::shared_ptr<std::vector<unsigned char> > tx;
+		if (it->second >= cache_size)
+			return recv_recent_txn.get(it->second - cache_size, tx, txid);
+		return recv_tx_cache.get(it->second, tx, txid);
+	};
+
 	for (uint32_t i = 0; i < message_size; i++) {
-		uint16_t index;
-		if (read_all((char*)&index, 2) != 2)
-			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
-		index = ntohs(index);
-		wire_bytes += 2;
+		bool tx_inline = false, abort = false;
+		uint32_t pos = 0, run_count = 0;
+		uint64_t run_check = 0;
+
+		if (useShortIds) {
+			unsigned char short_id_bytes[6];
+			if (read_all((char*)short_id_bytes, 6) != 6)
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx short id", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			wire_bytes += 6;
+
+			uint64_t short_id = 0;
+			for (int j = 0; j < 6; j++)
+				short_id = (short_id << 8) | short_id_bytes[j];
+
+			if (short_id == RELAY_SHORT_ID_INLINE)
+				tx_inline = true;
+			else if (short_id == RELAY_SHORT_ID_ABORT)
+				abort = true;
+			else if (useTxCoding && short_id == RELAY_SHORT_ID_RUN) {
+				unsigned char run_bytes[10];
+				if (read_all((char*)run_bytes, 10) != 10)
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx run", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				wire_bytes += 10;
+
+				pos = (run_bytes[0] << 8) | run_bytes[1];
+				run_count = (run_bytes[2] << 8) | run_bytes[3];
+				for (int j = 4; j < 10; j++)
+					run_check = (run_check << 8) | run_bytes[j];
+				if (!run_count || run_count > message_size - i || pos + run_count > cache_size)
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got a tx run outside of the block or cache", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			} else {
+				auto it = std::lower_bound(recv_short_ids.begin(), recv_short_ids.end(), std::make_pair(short_id, uint32_t(0)));
+				if (it == recv_short_ids.end() || it->first != short_id || (it + 1 != recv_short_ids.end() && (it + 1)->first == short_id))
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				pos = it->second;
+			}
+		} else {
+			uint16_t index;
+			if (read_all((char*)&index, 2) != 2)
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			index = ntohs(index);
+			wire_bytes += 2;
+
+			if (index == 0xffff)
+				tx_inline = true;
+			else {
+				if (index >= cache_size - recv_positions.size())
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				pos = index_tree_take(recv_index_tree, index);
+			}
+		}
 
-		txn_data[i].index = index;
+		size_t write_pos = block->size();
+		if (useTxCoding)
+			recv_tx_offsets.push_back(write_pos);
 
-		if (index == 0xffff) {
+		if (tx_inline) {
 			union intbyte {
 				uint32_t i;
 				char c[4];
@@ -284,38 +940,113 @@ std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*,
 				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx length", std::shared_ptr<std::vector<unsigned char> >(NULL));
 			tx_size.i = ntohl(tx_size.i);
 
+			bool tx_coded = useTxCoding && (tx_size.i & RELAY_TX_CODED_FLAG);
+			if (tx_coded)
+				tx_size.i &= ~RELAY_TX_CODED_FLAG;
+
 			if (tx_size.i > 1000000)
 				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got unreasonably large tx", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
-			txn_data[i].data.resize(tx_size.i);
-			if (read_all((char*)&(txn_data[i].data[0]), tx_size.i) != int64_t(tx_size.i))
-				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read transaction data", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			if (tx_coded) {
+				recv_coded_tx.resize(tx_size.i);
+				if (read_all((char*)&recv_coded_tx[0], tx_size.i) != int64_t(tx_size.i))
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read transaction data", std::shared_ptr<std::vector<unsigned char> >(NULL));
+
+				const char* err = decode_tx(recv_coded_tx, *block, 1000000, resolve_prevout);
+				if (err)
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), err, std::shared_ptr<std::vector<unsigned char> >(NULL));
+			} else {
+				block->resize(write_pos + tx_size.i);
+				if (read_all((char*)&(*block)[write_pos], tx_size.i) != int64_t(tx_size.i))
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read transaction data", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			}
 			wire_bytes += 3 + tx_size.i;
+			tx_size.i = block->size() - write_pos;
+			stats.misses++;
+			stats.miss_bytes += tx_size.i;
 
 			if (check_merkle)
-				double_sha256(&(txn_data[i].data[0]), merkleTree.getTxHashLoc(i), tx_size.i);
-		} else
-			txn_ptrs.emplace_back(index, i);
-	}
-
-	tweak_sort(txn_ptrs, 0, txn_ptrs.size());
-#ifndef NDEBUG
-	int32_t last = -1;
-#endif
-	for (size_t i = 0; i < txn_ptrs.size(); i++) {
-		const IndexPtr& ptr = txn_ptrs[i];
-		assert(last <= int(ptr.index) && (last = ptr.index) != -1);
+				double_sha256(&(*block)[write_pos], merkleTree.getTxHashLoc(i), tx_size.i);
+
+			// With short ids, txn whose id would have been ambiguous are sent in full even if we
+			// have them, and the sender still drops them from its cache
+			if (useShortIds) {
+				int cached_pos = recv_tx_cache.index_of(block->begin() + write_pos, block->end());
+				if (cached_pos >= 0)
+					recv_positions.push_back(cached_pos);
+			}
+		} else if (abort) {
+			// The sender removed everything it sent so far from its cache, so we have to as well
+			std::sort(recv_positions.begin(), recv_positions.end());
+			recv_positions.erase(std::unique(recv_positions.begin(), recv_positions.end()), recv_positions.end());
+			recv_tx_cache.remove_sorted(recv_positions, useTxCoding ? &recv_removed : NULL);
+			add_recent(recv_recent_txn, recv_removed);
+			{
+				std::lock_guard<std::mutex> seen_lock(seen_mutex);
+				blocksAlreadySeen.erase(*fullhashptr);
+			}
+			return std::make_tuple(wire_bytes, std::shared_ptr<std::vector<unsigned char> >(NULL), "ABORTED", fullhashptr);
+		} else if (run_count) {
+			uint64_t check = 0;
+			for (uint32_t j = 0; j < run_count; j++) {
+				std::shared_ptr<std::vector<unsigned char> > tx;
+				unsigned char* txid = check_merkle ? merkleTree.getTxHashLoc(i + j) : &recv_txids[32 * (i + j)];
+				if (!recv_tx_cache.get(pos + j, tx, txid))
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				if (!check_merkle)
+					recv_txid_known[i + j] = true;
+				check += short_txid(short_id_k0, short_id_k1, txid) * (j + 1);
+				recv_positions.push_back(pos + j);
+
+				if (j)
+					recv_tx_offsets.push_back(block->size());
+				block->insert(block->end(), tx->begin(), tx->end());
+			}
+			if ((check & 0xffffffffffffULL) != run_check)
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "tx run did not match our cache", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			i += run_count - 1;
+		} else {
+			std::shared_ptr<std::vector<unsigned char> > tx;
+			bool recent = pos >= cache_size;
+			if (!(recent ? recv_recent_txn.get(pos - cache_size, tx, merkleTree.getTxHashLoc(check_merkle ? i : 0)) :
+					recv_tx_cache.get(pos, tx, merkleTree.getTxHashLoc(check_merkle ? i : 0))))
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			if (!recent)
+				recv_positions.push_back(pos);
+
+			block->resize(write_pos + tx->size());
+			memcpy(&(*block)[write_pos], &(*tx)[0], tx->size());
+		}
 
-		if (!recv_tx_cache.remove(ptr.index, txn_data[ptr.pos].data, merkleTree.getTxHashLoc(check_merkle ? ptr.pos : 0)))
-			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+		size_t hash_bytes = (block->size() - msg_hashed) & ~size_t(63);
+		if (hash_bytes) {
+			double_sha256_step(&(*block)[msg_hashed], hash_bytes, msg_hash);
+			msg_hashed += hash_bytes;
+		}
 	}
 
-	for (uint32_t i = 0; i < message_size; i++)
-		block->insert(block->end(), txn_data[i].data.begin(), txn_data[i].data.end());
+	// A tx which is in a block twice is only cached once (the sender sends the second copy in full)
+	std::sort(recv_positions.begin(), recv_positions.end());
+	recv_positions.erase(std::unique(recv_positions.begin(), recv_positions.end()), recv_positions.end());
+	recv_tx_cache.remove_sorted(recv_positions, useTxCoding ? &recv_removed : NULL);
+	add_recent(recv_recent_txn, recv_removed);
 
-	if (check_merkle && !merkleTree.merkleRootMatches(&(*block)[4 + 32 + sizeof(bitcoin_msg_header)]))
+	if (check_merkle && !check_merkle_once(*fullhashptr, &(*block)[4 + 32 + sizeof(bitcoin_msg_header)], merkleTree.getTxHashLoc(0), message_size))
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "merkle tree root did not match", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
+	double_sha256_done(&(*block)[msg_hashed], block->size() - msg_hashed, block->size() - sizeof(bitcoin_msg_header), msg_hash);
+	prepare_message("block", &(*block)[0], block->size() - sizeof(bitcoin_msg_header), (unsigned char*)msg_hash);
+
+	// Time spent includes waiting on read_all, ie for the block to come in off the network
+	stats.block_bytes = block->size() - sizeof(bitcoin_msg_header);
+	stats.wire_bytes = wire_bytes + 80; // as counted by the sender
+	stats.time = std::chrono::steady_clock::now() - start_time;
+	recv_evictions_seen = recv_tx_cache.evictedCount();
+	{
+		std::lock_guard<std::mutex> stats_lock(stats_mutex);
+		recv_stats.add(stats);
+	}
+
 	return std::make_tuple(wire_bytes, block, (const char*) NULL, fullhashptr);
 }
 
@@ -5,9 +5,14 @@
 #include <tuple>
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <assert.h>
 
 #include "mruset.h"
 #include "flaggedarrayset.h"
+#include "blockview.h"
+#include "txcoder.h"
 #include "utils.h"
 
 #ifdef WIN32
@@ -19,35 +24,173 @@
 #define RELAY_DECLARE_CLASS_VARS \
 private: \
 	const uint32_t VERSION_TYPE, BLOCK_TYPE, TRANSACTION_TYPE, END_BLOCK_TYPE, MAX_VERSION_TYPE, \
-					OOB_TRANSACTION_TYPE, SPONSOR_TYPE, PING_TYPE, PONG_TYPE;
+					OOB_TRANSACTION_TYPE, SPONSOR_TYPE, PING_TYPE, PONG_TYPE, BLOCK_HEADER_TYPE, SESSION_TYPE, EVICT_TYPE, \
+					RECENT_TRANSACTION_TYPE, RESTORE_TYPE;
 
 #define RELAY_DECLARE_CONSTRUCTOR_EXTENDS \
 	VERSION_TYPE(htonl(0)), BLOCK_TYPE(htonl(1)), TRANSACTION_TYPE(htonl(2)), END_BLOCK_TYPE(htonl(3)), \
-	MAX_VERSION_TYPE(htonl(4)), OOB_TRANSACTION_TYPE(htonl(5)), SPONSOR_TYPE(htonl(6)), PING_TYPE(htonl(7)), PONG_TYPE(htonl(8))
+	MAX_VERSION_TYPE(htonl(4)), OOB_TRANSACTION_TYPE(htonl(5)), SPONSOR_TYPE(htonl(6)), PING_TYPE(htonl(7)), PONG_TYPE(htonl(8)), \
+	BLOCK_HEADER_TYPE(htonl(9)), SESSION_TYPE(htonl(10)), EVICT_TYPE(htonl(11)), \
+	RECENT_TRANSACTION_TYPE(htonl(12)), RESTORE_TYPE(htonl(13))
+
+// Compressors created with useShortIds instead send each tx as a 6-byte salted short txid, which
+// the receiver looks up by hash, so only which txn are cached matters, not their order.
+// These two values are reserved for a tx sent in full and for an aborted block. The latter is sent
+// in place of a tx when the sender of a streamed block finds it to be bad after part of it has
+// already gone out, both sides then keep the cache removals done so far and drop the block. Older
+// versions have no way to abort a block, so they are never sent one before it is known to be good.
+#define RELAY_SHORT_ID_INLINE 0xffffffffffffULL
+#define RELAY_SHORT_ID_ABORT 0xfffffffffffeULL
+
+#ifdef TEST_DATA
+// Every short id is masked with this, which test.cpp narrows to make collisions common
+extern uint64_t short_id_mask;
+#endif
+
+// Compressors which also useTxCoding may send txn in full in the form from txcoder.h, which is marked
+// by setting this bit in the 3-byte length in front of it
+#define RELAY_TX_CODED_FLAG 0x800000
+
+// They also treat the cache, which the server fills in fee order from getrawmempool as it goes, as
+// the predicted block and send the stretches of a block which follow it as a run:
+// RELAY_SHORT_ID_RUN, 2-byte first cache position, 2-byte count, then a 6-byte check which is the sum
+// of the short ids in the run, each multiplied by its 1-based place in it (catching misordered caches)
+#define RELAY_SHORT_ID_RUN 0xfffffffffffdULL
+
+// Txn which blocks take out of the cache go on to a second, FIFO, cache of recently mined txn (in
+// cache position order), so that a competing block soon after can still refer to them. Each block's
+// short id table covers both caches, with recent txn after the cache's own. Caching a tx again takes
+// it out of the recent cache, and RESTORE_TYPE messages do so without sending the tx again.
+#define RECENT_MAX_TXN 20000
+#define RECENT_MAX_SIZE (MAX_FAS_TOTAL_SIZE / 2)
+
+/********************************
+ **** Compression statistics ****
+ ********************************/
+// Counts of values in power-of-two buckets: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i)
+struct Histogram {
+	uint64_t buckets[65] = {}, count = 0, total = 0, max = 0;
+
+	void add(uint64_t value) {
+		buckets[value ? 64 - __builtin_clzll(value) : 0]++;
+		count++;
+		total += value;
+		if (value > max)
+			max = value;
+	}
+	// The upper bound of the bucket holding the given fraction (0-1) of values, at most max
+	uint64_t percentile(double fraction) const;
+};
+
+// What happened to one block going through a compressor. Blocks which are streamed, in either
+// direction, count the time spent waiting for the rest of the block to arrive.
+struct BlockCompressionStats {
+	uint32_t txn = 0, misses = 0;			// misses are txn which had to be sent in full
+	uint32_t miss_bytes = 0, block_bytes = 0, wire_bytes = 0;
+	uint32_t cache_txn = 0, cache_evictions = 0;	// cache size when the block started, evictions since the last one
+	std::chrono::steady_clock::duration time = std::chrono::steady_clock::duration::zero();
+};
+
+// Totals and per-block histograms over every block a compressor has handled in one direction.
+// A compressor's receive side belongs to one peer, the send side to everyone using its protocol version.
+struct CompressionStats {
+	uint64_t blocks = 0, txn = 0, misses = 0, block_bytes = 0, wire_bytes = 0;
+	Histogram miss_percent, miss_count, miss_bytes, bytes_saved, cache_txn, cache_evictions, micros;
+	BlockCompressionStats last;
+
+	void add(const BlockCompressionStats& block);
+	// Prints a one-line summary, tagged with name
+	void print(const char* name) const;
+};
+
+/*****************************
+ **** Tx caching policies ****
+ *****************************/
+// Which txn a protocol version caches and what each one counts against its cache's flag limit.
+// RelayNodeCompressor itself is not templated: its public tx entry points still test useOldFlags,
+// once per call, to pick the policy their private *_ helper is instantiated with, and the
+// constructor picks the cache limits the same way. A version which changes the rules gets a new
+// policy and a case in each of those dispatches rather than branches inside the helpers.
+struct OldFlagsPolicy {
+	static uint64_t max_txn() { return OLD_MAX_TXN_IN_FAS; }
+	static uint64_t max_flag_count() { return uint32_t(-1); }
+	// Only a few oversize txn may be cached at once, the flag marks them
+	static uint32_t flag(uint32_t tx_size) { return tx_size > OLD_MAX_RELAY_TRANSACTION_BYTES; }
+	static bool may_cache(uint32_t tx_size, uint64_t flag_count) {
+		return tx_size <= OLD_MAX_RELAY_TRANSACTION_BYTES ||
+			(flag_count < OLD_MAX_EXTRA_OVERSIZE_TRANSACTIONS && tx_size <= OLD_MAX_RELAY_OVERSIZE_TRANSACTION_BYTES);
+	}
+};
+
+struct SizeFlagsPolicy {
+	static uint64_t max_txn() { return 65000; }
+	static uint64_t max_flag_count() { return MAX_FAS_TOTAL_SIZE; }
+	// The flag is the tx's size, so the limit is on the cache's total size
+	static uint32_t flag(uint32_t tx_size) { return tx_size; }
+	static bool may_cache(uint32_t tx_size, uint64_t) { return tx_size <= MAX_RELAY_TRANSACTION_BYTES; }
+};
 
 class RelayNodeCompressor {
 	RELAY_DECLARE_CLASS_VARS
 
 private:
-	bool useOldFlags;
+	bool useOldFlags, useShortIds, useTxCoding;
 	FlaggedArraySet send_tx_cache, recv_tx_cache;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
-	std::mutex mutex;
+	// Only used with useTxCoding
+	FlaggedArraySet send_recent_txn, recv_recent_txn;
+	hashmruset blocksAlreadySeen;
+
+	// send_mutex covers send_tx_cache and the send side's scratch space, and is held for the life of a
+	// BlockCompressionStream. recv_mutex is the same for the receive side. seen_mutex only covers
+	// blocksAlreadySeen and stats_mutex send_stats and recv_stats, neither is held for more than a
+	// lookup or an update. Only reset() takes more than one, send_mutex first. Single FlaggedArraySet
+	// calls need none, the set locks itself.
+	std::mutex send_mutex, recv_mutex, seen_mutex, stats_mutex;
+
+	// Scratch space for decompress_relay_block, kept around so that resolving indexes doesn't allocate
+	std::vector<uint32_t> recv_index_tree, recv_positions;
+	std::vector<std::pair<uint64_t, uint32_t> > recv_short_ids;
+	std::vector<uint64_t> send_short_ids;
+	std::vector<std::pair<std::vector<unsigned char>::const_iterator, std::vector<unsigned char>::const_iterator> > send_batch;
+	std::vector<int> send_batch_indexes;
+	std::vector<unsigned char> send_batch_txids;
+	std::unordered_map<uint64_t, uint32_t> send_block_txids;
+	std::vector<uint32_t> send_positions;
+	std::vector<bool> send_used;
+	std::vector<uint32_t> recv_tx_offsets;
+	std::vector<unsigned char> recv_txids, recv_coded_tx;
+	std::vector<bool> recv_txid_known;
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > send_removed, recv_removed;
+	std::vector<uint32_t> send_evicted;
+
+	CompressionStats send_stats, recv_stats;
+	uint64_t send_evictions_seen = 0, recv_evictions_seen = 0;
 
 public:
-	RelayNodeCompressor(bool useOldFlagsIn)
-		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, useOldFlags(useOldFlagsIn),
-		  send_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE),
-		  recv_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE),
+	// useTxCoding requires useShortIds
+	RelayNodeCompressor(bool useOldFlagsIn, bool useShortIdsIn=false, bool useTxCodingIn=false)
+		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, useOldFlags(useOldFlagsIn), useShortIds(useShortIdsIn), useTxCoding(useTxCodingIn),
+		  send_tx_cache(useOldFlagsIn ? OldFlagsPolicy::max_txn() : SizeFlagsPolicy::max_txn(),
+				useOldFlagsIn ? OldFlagsPolicy::max_flag_count() : SizeFlagsPolicy::max_flag_count()),
+		  recv_tx_cache(useOldFlagsIn ? OldFlagsPolicy::max_txn() : SizeFlagsPolicy::max_txn(),
+				useOldFlagsIn ? OldFlagsPolicy::max_flag_count() : SizeFlagsPolicy::max_flag_count()),
+		  send_recent_txn(RECENT_MAX_TXN, RECENT_MAX_SIZE), recv_recent_txn(RECENT_MAX_TXN, RECENT_MAX_SIZE),
 		  blocksAlreadySeen(1000000) {}
 	RelayNodeCompressor& operator=(const RelayNodeCompressor& c) {
 		useOldFlags = c.useOldFlags;
+		useShortIds = c.useShortIds;
+		useTxCoding = c.useTxCoding;
 		send_tx_cache = c.send_tx_cache;
 		recv_tx_cache = c.recv_tx_cache;
+		send_recent_txn = c.send_recent_txn;
+		recv_recent_txn = c.recv_recent_txn;
 		blocksAlreadySeen = c.blocksAlreadySeen;
 		return *this;
 	}
 	void reset();
+	// Clear only one side's cache, ie when the server says a relay session could not be resumed
+	void reset_send();
+	void reset_recv();
 
 	inline std::shared_ptr<std::vector<unsigned char> > tx_to_msg(const std::shared_ptr<std::vector<unsigned char> >& tx, bool send_oob=false, bool include_data=true) const {
 		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
@@ -62,25 +205,195 @@ public:
 			msg->insert(msg->end(), tx->begin(), tx->end());
 		return msg;
 	}
+	// BLOCK_HEADER_TYPE messages carry just the 80-byte header of a new block, sent (to "salty templates"
+	// peers) as soon as the block is seen so that they can start on it before the BLOCK message arrives
+	inline std::shared_ptr<std::vector<unsigned char> > header_to_msg(const unsigned char* header) const {
+		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
+		struct relay_msg_header *msg_header = (struct relay_msg_header*)&(*msg)[0];
+		msg_header->magic = RELAY_MAGIC_BYTES;
+		msg_header->type = BLOCK_HEADER_TYPE;
+		msg_header->length = htonl(80);
+		msg->insert(msg->end(), header, header + 80);
+		return msg;
+	}
+	// SESSION_TYPE messages are 8-byte session id, 8-byte sequence number (both big-endian) and a
+	// byte which is 0 if there is no session (the client has none, or the server could not resume it)
+	inline std::shared_ptr<std::vector<unsigned char> > session_to_msg(uint64_t session_id, uint64_t seq, bool valid) const {
+		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
+		struct relay_msg_header *msg_header = (struct relay_msg_header*)&(*msg)[0];
+		msg_header->magic = RELAY_MAGIC_BYTES;
+		msg_header->type = SESSION_TYPE;
+		msg_header->length = htonl(17);
+		for (int i = 7; i >= 0; i--)
+			msg->push_back((session_id >> (8 * i)) & 0xff);
+		for (int i = 7; i >= 0; i--)
+			msg->push_back((seq >> (8 * i)) & 0xff);
+		msg->push_back(valid);
+		return msg;
+	}
+	// EVICT_TYPE messages are a list of 2-byte big-endian cache positions, each one removed in turn (so
+	// each is a position in the cache left by those before it)
+	inline std::shared_ptr<std::vector<unsigned char> > evict_to_msg(const std::vector<uint32_t>& indexes) const {
+		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
+		struct relay_msg_header *msg_header = (struct relay_msg_header*)&(*msg)[0];
+		msg_header->magic = RELAY_MAGIC_BYTES;
+		msg_header->type = EVICT_TYPE;
+		msg_header->length = htonl(indexes.size() * 2);
+		for (uint32_t index : indexes) {
+			assert(index < 0xffff);
+			msg->push_back(index >> 8);
+			msg->push_back(index & 0xff);
+		}
+		return msg;
+	}
+	// RECENT_TRANSACTION_TYPE messages carry a tx for the recent cache (when it is sent in full to a
+	// peer whose session could not be resumed). RESTORE_TYPE messages are the 2-byte big-endian
+	// position of a tx in the recent cache, which is moved back into the cache.
+	inline std::shared_ptr<std::vector<unsigned char> > recent_tx_to_msg(const std::shared_ptr<std::vector<unsigned char> >& tx, bool include_data=true) const {
+		auto msg = tx_to_msg(tx, false, include_data);
+		((struct relay_msg_header*)&(*msg)[0])->type = RECENT_TRANSACTION_TYPE;
+		return msg;
+	}
+	inline std::shared_ptr<std::vector<unsigned char> > restore_to_msg(uint16_t index) const {
+		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
+		struct relay_msg_header *msg_header = (struct relay_msg_header*)&(*msg)[0];
+		msg_header->magic = RELAY_MAGIC_BYTES;
+		msg_header->type = RESTORE_TYPE;
+		msg_header->length = htonl(2);
+		msg->push_back(index >> 8);
+		msg->push_back(index & 0xff);
+		return msg;
+	}
 	std::shared_ptr<std::vector<unsigned char> > get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	// For compressors where evicts_by_fee(): the peer ("salty templates" or later) is told what to evict
+	// instead of evicting the oldest txn itself, so when the cache is full the txn with the lowest
+	// fee_per_kb (the least likely to be mined) go first. If any are, evict_msg is set to the EVICT
+	// message, which has to reach the peer just before the tx. Txn with equal fees (eg all those the
+	// mempool server gave no fee for, at 0) go oldest first. Once a compressor has been given a fee
+	// its cache no longer evicts in insertion order, so it must not go through the other overload.
+	// A tx which is still in the recent cache (ie its block was orphaned) is sent as a RESTORE message.
+	std::shared_ptr<std::vector<unsigned char> > get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, uint64_t fee_per_kb,
+			std::shared_ptr<std::vector<unsigned char> >& evict_msg);
+	bool evicts_by_fee() const { return useTxCoding; }
+	// Whether the peer can be told to drop a block partway through (RELAY_SHORT_ID_ABORT), ie whether
+	// a block may be streamed to it before it is known to be good
+	bool can_abort_blocks() const { return useShortIds; }
 
 	bool maybe_recv_tx_of_size(uint32_t tx_size, bool debug_print);
 	void recv_tx(std::shared_ptr<std::vector<unsigned char > > tx);
+	// Removes the txn listed in an EVICT message's payload, returns NULL or an error
+	const char* recv_evict(const std::vector<unsigned char>& indexes);
+	void recv_recent_tx(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	// Moves the tx at the position given in a RESTORE message's payload into the cache, returns NULL
+	// (setting tx to it) or an error
+	const char* recv_restore(const std::vector<unsigned char>& data, std::shared_ptr<std::vector<unsigned char> >& tx);
 
 	void for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback);
+	void for_each_recent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback);
 
-	std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle);
+	std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> maybe_compress_block(const BlockView& block, bool check_merkle);
+	// The returned block has its bitcoin_msg_header (including checksum) already filled in
 	std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle);
 
 	bool block_sent(std::vector<unsigned char>& hash);
 	uint32_t blocks_sent();
+	// For a block which passed compressors[0] but wasn't compressed here (as nobody was listening):
+	// drops its txn from send_tx_cache as compressing it would have, and marks it sent, without
+	// building anything
+	void block_mined(const BlockView& block);
 
 	bool was_tx_sent(const unsigned char* txhash);
 
+	// Copies of the stats for blocks sent (compressed) and received (decompressed)
+	CompressionStats get_send_stats();
+	CompressionStats get_recv_stats();
+
 private:
+	template<typename Policy> std::shared_ptr<std::vector<unsigned char> > get_relay_transaction_(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	template<typename Policy> bool check_recv_tx_(uint32_t tx_size);
+	template<typename Policy> void recv_tx_(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	template<typename Policy> const char* recv_restore_(const std::vector<unsigned char>& data, std::shared_ptr<std::vector<unsigned char> >& tx);
 	bool check_recv_tx(uint32_t tx_size);
+	// Appends txn removed from a cache by a block to the matching recent cache
+	void add_recent(FlaggedArraySet& recent, std::vector<std::shared_ptr<std::vector<unsigned char> > >& removed);
+
+	friend class BlockCompressionStream;
 
 	friend void test_compress_block(std::vector<unsigned char>&, std::vector<std::shared_ptr<std::vector<unsigned char> > >);
+	friend void test_caches_match(RelayNodeCompressor&, RelayNodeCompressor&, const char*);
+};
+
+/*******************************
+ **** Block validation memo ****
+ *******************************/
+// Remembers the last few blocks (by hash) whose merkle root has been checked, along with the txids
+// it was checked against, so that a block is only checked once however many compressors and paths
+// it goes through. Shared by every compressor in the process and thread-safe.
+
+// Returns true if txcount txids hash to merkle_root. The merkle tree is only built if the block has
+// not already been checked with exactly these txids. The memo is only locked to look up and insert,
+// never while hashing, so checks of different blocks (and racing checks of one) run in parallel.
+bool check_merkle_once(const std::vector<unsigned char>& hash, const unsigned char* merkle_root, const unsigned char* txids, uint32_t txcount);
+// The txids a block was checked with, or NULL if it has not been. Only to be used in place of
+// hashing txn which are known to be from the block that was checked (eg a block just decompressed).
+std::shared_ptr<const std::vector<unsigned char> > get_checked_txids(const std::vector<unsigned char>& hash);
+
+/***************************************
+ **** Cut-through block compression ****
+ ***************************************/
+// Compresses a block one transaction at a time, appending each piece of the relay BLOCK message to
+// out as soon as it is known, so that it can be forwarded while the rest of the block is still
+// arriving. The compressor's send side is locked for the life of the stream.
+// The last tx is held back until finish(), so that if the merkle root turns out not to match, an
+// abort (RELAY_SHORT_ID_ABORT) can still be sent in its place. Only compressors which
+// can_abort_blocks() may check_merkle or abort. Transactions passed to add_tx must stay valid until
+// finish() or abort() is called.
+class BlockCompressionStream {
+private:
+	RelayNodeCompressor& compressor;
+	std::lock_guard<std::mutex> lock;
+
+	const bool check_work, check_merkle;
+	std::vector<unsigned char> hash, merkle_root, txids;
+	uint64_t short_id_k0, short_id_k1;
+	uint32_t txcount, txn_done, run_start, run_count, run_first_tx;
+	BlockCompressionStats stats;
+	size_t out_start;
+	std::chrono::steady_clock::time_point start_time;
+	std::vector<unsigned char>::const_iterator last_tx_begin, last_tx_end;
+	bool started, finished;
+
+	void write_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, std::vector<unsigned char>& out);
+	// Writes a tx which has already been removed from the cache (index is -1 if it wasn't there)
+	void write_removed_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, int index, const unsigned char* txid, std::vector<unsigned char>& out);
+	void write_inline(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, uint32_t tx_index, std::vector<unsigned char>& out);
+	void flush_run(std::vector<unsigned char>& out);
+	void remove_sent();
+	int prevout_ref(const unsigned char* txid, uint32_t tx_index, uint64_t& ref);
+
+public:
+	BlockCompressionStream(RelayNodeCompressor& compressorIn, bool check_work_in, bool check_merkle_in);
+	~BlockCompressionStream();
+
+	// header is the 80-byte block header. Returns NULL or an error as from maybe_compress_block
+	const char* start(const unsigned char* header, const std::vector<unsigned char>& hashIn, uint32_t tx_count, std::vector<unsigned char>& out);
+	// txid may be given if it is already known (it is only needed with check_merkle or useTxCoding)
+	void add_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end, std::vector<unsigned char>& out, const unsigned char* txid=NULL);
+	// Adds every tx in block but the last one (which still has to be passed to add_tx), looking them
+	// all up in the cache in one batch. Only for streams without check_merkle or useTxCoding.
+	void add_block_txn(const BlockView& block, std::vector<unsigned char>& out);
+	// Must be called once all tx_count txn have been added, returns NULL if the block was sent
+	// complete, otherwise the block has been aborted
+	const char* finish(std::vector<unsigned char>& out);
+	// Aborts a started block (ie if the rest of it could not be read). Only if can_abort_blocks().
+	void abort(std::vector<unsigned char>& out);
+
+	bool is_started() const { return started; }
+	bool is_finished() const { return finished; }
+	uint32_t tx_count() const { return txcount; }
+	uint32_t txn_added() const { return txn_done; }
+	// Whether add_tx will hash txn which are given without a txid
+	bool needs_txids() const { return check_merkle || compressor.useTxCoding; }
 };
 
 #endif
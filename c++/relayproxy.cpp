@@ -73,6 +73,13 @@ private:
 			return reconnect("failed to write version header", true);
 		if (send_all(sock, VERSION_STRING, strlen(VERSION_STRING)) != strlen(VERSION_STRING))
 			return reconnect("failed to write version string", true);
+		// We don't keep a session, this just gets the server to start sending
+		relay_msg_header session_header = { RELAY_MAGIC_BYTES, SESSION_TYPE, htonl(17) };
+		char no_session[17] = {};
+		if (send_all(sock, (char*)&session_header, sizeof(session_header)) != sizeof(session_header))
+			return reconnect("failed to write session header", true);
+		if (send_all(sock, no_session, sizeof(no_session)) != sizeof(no_session))
+			return reconnect("failed to write session message", true);
 
 		int nodelay = 1;
 		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
@@ -271,7 +271,7 @@ void RPCClient::net_process(const std::function<void(std::string)>& disconnect)
 		if (!txnWaitingOnDeps.empty())
 			return disconnect("Tx depended on another one which did not exist");
 
-		std::vector<std::pair<std::vector<unsigned char>, size_t> > txn_selected;
+		std::vector<std::tuple<std::vector<unsigned char>, size_t, uint64_t> > txn_selected;
 		std::function<bool (const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)> comp = [](const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) {
 			return a->feePerKb < b->feePerKb || (a->feePerKb == b->feePerKb && a->prio < b->prio);
 		};
@@ -290,7 +290,7 @@ void RPCClient::net_process(const std::function<void(std::string)>& disconnect)
 						vectorToSort.push_back(dep);
 						std::push_heap(vectorToSort.begin(), vectorToSort.end(), comp);
 					}
-				txn_selected.push_back(std::make_pair(e->hash, e->size));
+				txn_selected.push_back(std::make_tuple(e->hash, e->size, e->feePerKb));
 				totalSizeSelected += e->size;
 				if (e->feePerKb == minFeePerKbSelected)
 					minFeePerKbTxnCount++;
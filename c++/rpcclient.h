@@ -2,7 +2,7 @@
 #define _RELAY_RPCCLIENT_H
 
 #include <vector>
-#include <utility>
+#include <tuple>
 #include <string>
 #include <stdint.h>
 
@@ -10,13 +10,14 @@
 
 class RPCClient : public OutboundPersistentConnection {
 private:
-	const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >&, size_t)> txn_for_block_func;
+	// Called with the (hash, size, feePerKb) of each tx selected for the next block, in fee order
+	const std::function<void (std::vector<std::tuple<std::vector<unsigned char>, size_t, uint64_t> >&, size_t)> txn_for_block_func;
 
 	std::atomic_bool connected;
 	std::atomic_bool awaiting_response;
 
 public:
-	RPCClient(std::string hostIn, int16_t portIn, const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >& txhashes, size_t total_mempool_size)>& txn_for_block_func_in)
+	RPCClient(std::string hostIn, int16_t portIn, const std::function<void (std::vector<std::tuple<std::vector<unsigned char>, size_t, uint64_t> >& txn, size_t total_mempool_size)>& txn_for_block_func_in)
 		: OutboundPersistentConnection(hostIn, portIn), txn_for_block_func(txn_for_block_func_in) { on_disconnect(); construction_done(); }
 	void maybe_get_txn_for_block();
 
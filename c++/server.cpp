@@ -3,6 +3,10 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <deque>
+#include <list>
+#include <random>
+#include <future>
 
 #include <assert.h>
 #include <string.h>
@@ -18,6 +22,7 @@
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
 #include "relayprocess.h"
+#include "blockview.h"
 #include "utils.h"
 #include "p2pclient.h"
 #include "connection.h"
@@ -29,7 +34,7 @@
 static const char* HOST_SPONSOR;
 
 
-static const std::map<std::string, int16_t> compressor_types = {{std::string("sponsor printer"), 1}, {std::string("spammy memeater"), 0}, {std::string("the blocksize"), 1}};
+static const std::map<std::string, int16_t> compressor_types = {{std::string("sponsor printer"), 1}, {std::string("spammy memeater"), 0}, {std::string("the blocksize"), 1}, {std::string("short and salty"), 2}, {std::string("salty templates"), 3}};
 
 
 /***********************************************
@@ -38,12 +43,19 @@ static const std::map<std::string, int16_t> compressor_types = {{std::string("sp
 class RelayNetworkClient : public Connection {
 private:
 	std::atomic_int connected;
-	bool sendSponsor = false;
+	bool sendSponsor = false, sendHeaders = false, awaitSession = false;
 	uint8_t tx_sent = 0;
+	// While a cut-through block is being streamed to us, anything else sent is held back until its
+	// end, so that it doesn't land in the middle of the BLOCK message. Only changed (and deferred only
+	// touched) with the send mutex held.
+	std::atomic_bool block_streaming;
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > deferred;
 
 	const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)> provide_block;
+	const std::function<void (RelayNetworkClient*, const unsigned char*, const std::vector<unsigned char>&)> provide_header;
 	const std::function<void (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
-	const std::function<void (RelayNetworkClient*, int)> connected_callback;
+	const std::function<void (RelayNetworkClient*)> connected_callback;
+	const std::function<void (RelayNetworkClient*, uint64_t, uint64_t)> resume_session;
 
 	RELAY_DECLARE_CLASS_VARS
 
@@ -55,20 +67,36 @@ public:
 
 	RelayNetworkClient(int sockIn, std::string hostIn,
 						const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)>& provide_block_in,
+						const std::function<void (RelayNetworkClient*, const unsigned char*, const std::vector<unsigned char>&)>& provide_header_in,
 						const std::function<void (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
-						const std::function<void (RelayNetworkClient*, int)>& connected_callback_in)
-			: Connection(sockIn, hostIn, NULL), connected(0),
-			provide_block(provide_block_in), provide_transaction(provide_transaction_in), connected_callback(connected_callback_in),
+						const std::function<void (RelayNetworkClient*)>& connected_callback_in,
+						const std::function<void (RelayNetworkClient*, uint64_t, uint64_t)>& resume_session_in)
+			: Connection(sockIn, hostIn, NULL), connected(0), block_streaming(false),
+			provide_block(provide_block_in), provide_header(provide_header_in), provide_transaction(provide_transaction_in), connected_callback(connected_callback_in),
+			resume_session(resume_session_in),
 			RELAY_DECLARE_CONSTRUCTOR_EXTENDS, compressor(false), compressor_type(-1) // compressor is always replaced in VERSION_TYPE recv
 	{ construction_done(); }
 
 private:
-	void send_sponsor(int token=0) {
+	// Everything sent once we are connected goes through here, with the send mutex held
+	void send_msg(const std::shared_ptr<std::vector<unsigned char> >& msg, int token) {
+		if (block_streaming)
+			deferred.push_back(msg);
+		else
+			do_send_bytes(msg, token);
+	}
+
+	void send_msg(const relay_msg_header& header, const char* data, size_t len, int token) {
+		auto msg = std::make_shared<std::vector<unsigned char> >((unsigned char*)&header, (unsigned char*)&header + sizeof(header));
+		msg->insert(msg->end(), data, data + len);
+		send_msg(msg, token);
+	}
+
+	void send_sponsor(int token) {
 		if (!sendSponsor || tx_sent != 0)
 			return;
 		relay_msg_header sponsor_header = { RELAY_MAGIC_BYTES, SPONSOR_TYPE, htonl(strlen(HOST_SPONSOR)) };
-		do_send_bytes((char*)&sponsor_header, sizeof(sponsor_header), token);
-		do_send_bytes(HOST_SPONSOR, strlen(HOST_SPONSOR), token);
+		send_msg(sponsor_header, HOST_SPONSOR, strlen(HOST_SPONSOR), token);
 	}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
@@ -111,24 +139,46 @@ private:
 
 				compressor_type = it->second;
 
-				if (their_version == "spammy memeater")
+				if (their_version == "salty templates")
+					compressor = RelayNodeCompressor(false, true, true);
+				else if (their_version == "short and salty")
+					compressor = RelayNodeCompressor(false, true);
+				else if (their_version == "spammy memeater")
 					compressor = RelayNodeCompressor(false);
 				else
 					compressor = RelayNodeCompressor(true);
 
 				if (their_version != "the blocksize")
 					sendSponsor = true;
+				if (their_version == "salty templates")
+					sendHeaders = true;
 
 				relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(message_size) };
 				do_send_bytes((char*)&version_header, sizeof(version_header));
 				do_send_bytes(data, message_size);
 
 				printf("%s Connected to relay node with protocol version %s\n", host.c_str(), data);
-				int token = get_send_mutex();
-				connected = 2;
-				do_throttle_outbound();
-				connected_callback(this, token); // Called with send_mutex!
-				release_send_mutex(token);
+				if (their_version == "salty templates") {
+					// Nothing is sent until the client's SESSION_TYPE says what it already has
+					awaitSession = true;
+					continue;
+				}
+				connected_callback(this);
+			} else if (header.type == SESSION_TYPE) {
+				unsigned char data[17];
+				if (message_size != 17 || read_all((char*)data, 17) < 17)
+					return disconnect("failed to read session message");
+
+				// Any later ones are ignored (relayproxy forwards another server's to us)
+				if (awaitSession && connected != 2) {
+					awaitSession = false;
+					uint64_t session_id = 0, seq = 0;
+					for (int i = 0; i < 8; i++) {
+						session_id = (session_id << 8) | data[i];
+						seq = (seq << 8) | data[8 + i];
+					}
+					resume_session(this, data[16] ? session_id : 0, seq);
+				}
 			} else if (connected != 2) {
 				return disconnect("got non-version before version");
 			} else if (header.type == MAX_VERSION_TYPE) {
@@ -148,7 +198,10 @@ private:
 				std::chrono::system_clock::time_point read_start(std::chrono::system_clock::now());
 				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) { return read_all(buf, count); };
 				auto res = compressor.decompress_relay_block(do_read, message_size, true);
-				if (std::get<2>(res))
+				if (std::get<2>(res) && !strcmp(std::get<2>(res), "ABORTED")) {
+					printf(HASH_FORMAT" ABORTED UNTRUSTEDRELAY %s\n", HASH_PRINT(&(*std::get<3>(res))[0]), host.c_str());
+					continue;
+				} else if (std::get<2>(res))
 					return disconnect(std::get<2>(res));
 				std::chrono::system_clock::time_point read_finish(std::chrono::system_clock::now());
 
@@ -162,6 +215,16 @@ private:
 													(unsigned)std::get<0>(res), bytes_sent, (unsigned)std::get<1>(res)->size(),
 													to_millis_double(read_finish - read_start), to_millis_double(send_queued - read_finish));
 				}
+			} else if (header.type == BLOCK_HEADER_TYPE) {
+				std::vector<unsigned char> block_header(80), fullhash(32);
+				if (message_size != 80 || read_all((char*)&block_header[0], 80) < 80)
+					return disconnect("failed to read 80 byte block header");
+
+				getblockhash(fullhash, block_header, 0);
+				if (!check_header_work(&block_header[0], fullhash))
+					return disconnect("got block header which did not meet its target");
+
+				provide_header(this, &block_header[0], fullhash);
 			} else if (header.type == END_BLOCK_TYPE) {
 			} else if (header.type == TRANSACTION_TYPE) {
 				if (!compressor.maybe_recv_tx_of_size(message_size, false))
@@ -190,8 +253,7 @@ private:
 				relay_msg_header pong_msg_header = { RELAY_MAGIC_BYTES, PONG_TYPE, htonl(8) };
 
 				int token = get_send_mutex();
-				do_send_bytes((char*)&pong_msg_header, sizeof(pong_msg_header), token);
-				do_send_bytes(data, 8, token);
+				send_msg(pong_msg_header, data, 8, token);
 				release_send_mutex(token);
 			} else
 				return disconnect("got unknown message type");
@@ -203,32 +265,102 @@ public:
 		if (connected != 2)
 			return;
 
-		do_send_bytes(tx, token);
+		bool own_token = !token;
+		if (own_token)
+			token = get_send_mutex();
+		send_msg(tx, token);
 		tx_sent++;
-		if (!token)
+		if (own_token) {
 			send_sponsor(token);
+			release_send_mutex(token);
+		}
+	}
+
+	CompressionStats get_recv_stats() {
+		return compressor.get_recv_stats();
 	}
 
-	void receive_block(const std::shared_ptr<std::vector<unsigned char> >& block) {
+	void receive_header(const std::shared_ptr<std::vector<unsigned char> >& msg) {
+		if (connected != 2 || !sendHeaders)
+			return;
+		int token = get_send_mutex();
+		send_msg(msg, token);
+		release_send_mutex(token);
+	}
+
+	void receive_block(const std::shared_ptr<std::vector<unsigned char> >& block, int token=0) {
 		if (connected != 2)
 			return;
 
-		int token = get_send_mutex();
-		do_send_bytes(block, token);
+		bool own_token = !token;
+		if (own_token)
+			token = get_send_mutex();
+		send_msg(block, token);
 		struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
-		do_send_bytes((char*)&header, sizeof(header), token);
+		send_msg(header, NULL, 0, token);
+		if (own_token)
+			release_send_mutex(token);
+	}
+
+	// Used by connected_callback and resume_session: the send mutex is held from begin_session until
+	// end_session so that the client gets its SESSION_TYPE messages and cache before anything else
+	int begin_session() {
+		int token = get_send_mutex();
+		connected = 2;
+		do_throttle_outbound();
+		return token;
+	}
+
+	void send_session(uint64_t session_id, uint64_t seq, bool valid, int token) {
+		send_msg(compressor.session_to_msg(session_id, seq, valid), token);
+	}
+
+	void end_session(int token) {
+		release_send_mutex(token);
+	}
+
+	// For cut-through relay: between begin_block_stream and end_block_stream only block chunks go
+	// out, everything else is deferred. The send mutex is only taken for each call, and the client
+	// is not culled until the stream ends.
+	bool begin_block_stream() {
+		if (connected != 2)
+			return false;
+		int token = get_send_mutex();
+		bool started = !block_streaming;
+		block_streaming = true;
+		release_send_mutex(token);
+		return started;
+	}
+
+	void send_block_chunk(const std::shared_ptr<std::vector<unsigned char> >& chunk) {
+		do_send_bytes(chunk);
+	}
+
+	void end_block_stream(bool block_sent) {
+		int token = get_send_mutex();
+		if (block_sent) {
+			struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
+			do_send_bytes((char*)&header, sizeof(header), token);
+		}
+		block_streaming = false;
+		for (const auto& msg : deferred)
+			do_send_bytes(msg, token);
+		deferred.clear();
 		release_send_mutex(token);
 	}
+
+	bool is_block_streaming() const { return block_streaming; }
 };
 
 class P2PClient : public P2PRelayer {
 public:
 	P2PClient(const char* serverHostIn, uint16_t serverPortIn,
-				const std::function<void (std::vector<unsigned char>&, const std::chrono::system_clock::time_point&)>& provide_block_in,
+				const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const std::chrono::system_clock::time_point&)>& provide_block_in,
 				const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
 				const std::function<void (std::vector<unsigned char>&)>& provide_headers_in,
-				bool check_block_msghash_in) :
-			P2PRelayer(serverHostIn, serverPortIn, 10000, provide_block_in, provide_transaction_in, provide_headers_in, check_block_msghash_in)
+				bool check_block_msghash_in,
+				const std::function<void (const std::vector<unsigned char>&, size_t)>& provide_block_progress_in) :
+			P2PRelayer(serverHostIn, serverPortIn, 10000, provide_block_in, provide_transaction_in, provide_headers_in, check_block_msghash_in, provide_block_progress_in)
 		{ construction_done(); }
 
 private:
@@ -244,9 +376,13 @@ private:
 class RelayNetworkCompressor : public RelayNodeCompressor {
 public:
 	RelayNetworkCompressor() : RelayNodeCompressor(false) {}
-	RelayNetworkCompressor(bool useFlagsAndSmallerMax) : RelayNodeCompressor(useFlagsAndSmallerMax) {}
+	RelayNetworkCompressor(bool useFlagsAndSmallerMax, bool useShortIds=false, bool useTxCoding=false) : RelayNodeCompressor(useFlagsAndSmallerMax, useShortIds, useTxCoding) {}
 
 	void relay_node_connected(RelayNetworkClient* client, int token) {
+		for_each_recent_tx([&] (const std::shared_ptr<std::vector<unsigned char> >& tx) {
+			client->receive_transaction(recent_tx_to_msg(tx, false), token);
+			client->receive_transaction(tx, token);
+		});
 		for_each_sent_tx([&] (const std::shared_ptr<std::vector<unsigned char> >& tx) {
 			client->receive_transaction(tx_to_msg(tx, false, false), token);
 			client->receive_transaction(tx, token);
@@ -254,33 +390,451 @@ public:
 	}
 };
 
-#define COMPRESSOR_TYPES 2
+#define COMPRESSOR_TYPES 4
 static RelayNetworkCompressor compressors[COMPRESSOR_TYPES];
 class CompressorInit {
 public:
 	CompressorInit() {
 		compressors[0] = RelayNetworkCompressor(false);
 		compressors[1] = RelayNetworkCompressor(true);
+		compressors[2] = RelayNetworkCompressor(false, true);
+		compressors[3] = RelayNetworkCompressor(false, true, true);
 	}
 };
 static CompressorInit init;
 
 
+/**************************************************************
+ **** Recently compressed blocks, by (hash, compressor type) ****
+ **************************************************************/
+class CompressedBlockCache {
+private:
+	typedef std::pair<std::vector<unsigned char>, int16_t> Key;
+	std::map<Key, std::shared_ptr<std::vector<unsigned char> > > images;
+	std::deque<Key> order;
+	const size_t max_images;
+
+public:
+	CompressedBlockCache(size_t max_images_in) : max_images(max_images_in) {}
+
+	std::shared_ptr<std::vector<unsigned char> > get(const std::vector<unsigned char>& hash, int16_t type) const {
+		auto it = images.find(std::make_pair(hash, type));
+		if (it == images.end())
+			return std::shared_ptr<std::vector<unsigned char> >();
+		return it->second;
+	}
+
+	void add(const std::vector<unsigned char>& hash, int16_t type, const std::shared_ptr<std::vector<unsigned char> >& image) {
+		Key key(hash, type);
+		if (!images.insert(std::make_pair(key, image)).second)
+			return;
+		order.push_back(key);
+		while (order.size() > max_images) {
+			images.erase(order.front());
+			order.pop_front();
+		}
+	}
+};
+
+
+/***************************************
+ **** Early block header announcement ****
+ ***************************************/
+// Sends the header of each new block to clients which take BLOCK_HEADER_TYPE messages the first
+// time we see the block, before compressing it. Only used with map_mutex held, and must be called
+// before any client send mutexes are taken.
+class HeaderAnnouncer {
+private:
+	std::map<std::string, RelayNetworkClient*>& clientMap;
+	mruset<std::vector<unsigned char> > announced;
+
+public:
+	HeaderAnnouncer(std::map<std::string, RelayNetworkClient*>& clientMap_in) : clientMap(clientMap_in), announced(100) {}
+
+	void announce(const unsigned char* header, const std::vector<unsigned char>& hash) {
+		if (!check_header_work(header, hash) || !announced.insert(hash).second)
+			return;
+
+		auto msg = compressors[0].header_to_msg(header);
+		for (const auto& client : clientMap)
+			if (!client.second->getDisconnectFlags())
+				client.second->receive_header(msg);
+	}
+};
+
+
+/********************************************
+ **** Per-compressor-type ordering locks ****
+ ********************************************/
+// Held from when something changes compressors[i]'s send side (a tx, a block or a whole cut-through
+// stream) until the result has been queued to its clients, so that they get messages in the order
+// the compressor made them. A cut-through stream holds it for as long as bitcoind takes to deliver
+// the block, so txn for a busy type are queued rather than waited for and relayed by whoever next
+// unlocks it. Lock order is type locks (lowest type first), then map_mutex, then client send
+// mutexes, and map_mutex must not be held when unlocking (relaying queued txn takes it).
+class RelayTypeLock {
+private:
+	std::mutex mutex, pending_mutex;
+	std::deque<std::pair<std::shared_ptr<std::vector<unsigned char> >, uint64_t> > pending;
+	std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, uint64_t)> relay_tx;
+
+public:
+	// relay_tx is called with the lock held for each tx which was queued
+	void set_relay_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, uint64_t)>& relay_tx_in) { relay_tx = relay_tx_in; }
+
+	void lock() { mutex.lock(); }
+
+	// Returns true with the lock held, or queues the tx (with its fee per kB) and returns false
+	bool try_lock_or_queue(const std::shared_ptr<std::vector<unsigned char> >& tx, uint64_t fee_per_kb) {
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		if (mutex.try_lock())
+			return true;
+		pending.emplace_back(tx, fee_per_kb);
+		return false;
+	}
+
+	void unlock() {
+		while (true) {
+			std::deque<std::pair<std::shared_ptr<std::vector<unsigned char> >, uint64_t> > txn;
+			{
+				// Checked and unlocked under pending_mutex so nothing can be queued behind our back
+				std::lock_guard<std::mutex> lock(pending_mutex);
+				if (pending.empty()) {
+					mutex.unlock();
+					return;
+				}
+				txn.swap(pending);
+			}
+			for (const auto& tx : txn)
+				relay_tx(tx.first, tx.second);
+		}
+	}
+};
+
+
+/*******************************
+ **** Relay session history ****
+ *******************************/
+// Every message which changes a send compressor's cache (each tx and block, in the order they go out
+// to clients) is numbered, and the most recent are kept, so that a "salty templates" client which
+// reconnects can be sent only what it missed instead of the whole cache. A client which can't be
+// resumed is reset and sent the cache, then told the number it is at. Only used with map_mutex held,
+// and each type's history only with its RelayTypeLock held, which is also held whenever those
+// messages go out.
+#define SESSION_HISTORY_BYTES (2 * 1024 * 1024)
+
+class SessionHistory {
+private:
+	uint64_t session_id, first_seq;
+	std::deque<std::pair<bool, std::shared_ptr<std::vector<unsigned char> > > > msgs;
+	size_t bytes;
+
+public:
+	SessionHistory() : first_seq(0), bytes(0) {
+		std::random_device rand;
+		do {
+			session_id = (uint64_t(rand()) << 32) | rand();
+		} while (!session_id);
+	}
+
+	void add(const std::shared_ptr<std::vector<unsigned char> >& msg, bool is_block) {
+		msgs.emplace_back(is_block, msg);
+		bytes += msg->size();
+		while (bytes > SESSION_HISTORY_BYTES && msgs.size() > 1) {
+			bytes -= msgs.front().second->size();
+			msgs.pop_front();
+			first_seq++;
+		}
+	}
+
+	void resume(RelayNetworkClient* client, RelayNetworkCompressor& compressor, uint64_t their_session_id, uint64_t their_seq) {
+		uint64_t end_seq = first_seq + msgs.size();
+		int token = client->begin_session();
+		if (their_session_id == session_id && their_seq >= first_seq && their_seq <= end_seq) {
+			client->send_session(session_id, their_seq, true, token);
+			for (auto it = msgs.begin() + (their_seq - first_seq); it != msgs.end(); it++) {
+				if (it->first)
+					client->receive_block(it->second, token);
+				else
+					client->receive_transaction(it->second, token);
+			}
+			printf("%s Resumed relay session, sent %lu missed messages\n", client->host.c_str(), (unsigned long)(end_seq - their_seq));
+		} else {
+			client->send_session(0, 0, false, token);
+			compressor.relay_node_connected(client, token);
+			client->send_session(session_id, end_seq, true, token);
+		}
+		client->end_session(token);
+	}
+};
+
+
+/***************************************************
+ **** Cut-through relay of blocks from bitcoind ****
+ ***************************************************/
+// Compresses and forwards a block to relay clients while it is still being read from bitcoind.
+// There is one per P2PClient: progress() is its provide_block_progress callback and finish() must be
+// called first thing in its provide_block. Only versions which can be told to drop a block partway
+// through get it streamed, the rest get it from do_relay once it is all here and checked.
+// From the moment the block's header arrives until finish() the streamed types' RelayTypeLocks are
+// held, but map_mutex and client send mutexes are only taken briefly (ie once per chunk sent).
+class BlockCutThrough {
+private:
+	std::mutex& map_mutex;
+	std::map<std::string, RelayNetworkClient*>& clientMap;
+	CompressedBlockCache& compressedBlocks;
+	HeaderAnnouncer& announcer;
+	SessionHistory* sessions;
+	RelayTypeLock* typeLocks;
+	const bool check_merkle;
+
+	std::unique_ptr<BlockStreamParser> parser;
+	std::vector<unsigned char> hash;
+	bool active = false, skip = false;
+
+	std::unique_lock<RelayTypeLock> type_locks[COMPRESSOR_TYPES];
+	std::unique_ptr<BlockCompressionStream> streams[COMPRESSOR_TYPES];
+	std::shared_ptr<std::vector<unsigned char> > images[COMPRESSOR_TYPES];
+	size_t sent[COMPRESSOR_TYPES];
+	bool complete[COMPRESSOR_TYPES];
+	struct Receiver {
+		RelayNetworkClient* client;
+		int16_t type;
+	};
+	// Clients are not culled while they are in a block stream, so these stay valid until reset()
+	std::list<Receiver> receivers;
+
+	void send_pending(int16_t type) {
+		std::vector<unsigned char>& image = *images[type];
+		if (sent[type] == image.size())
+			return;
+		auto chunk = std::make_shared<std::vector<unsigned char> >(image.begin() + sent[type], image.end());
+		sent[type] = image.size();
+		for (const Receiver& r : receivers)
+			if (r.type == type)
+				r.client->send_block_chunk(chunk);
+	}
+
+	void abort_all() {
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			if (streams[i]) {
+				streams[i]->abort(*images[i]);
+				send_pending(i);
+			}
+		}
+	}
+
+	void reset() {
+		for (const Receiver& r : receivers)
+			r.client->end_block_stream(sent[r.type] != 0);
+		receivers.clear();
+
+		// Done with the compressors before map_mutex is taken
+		bool finished[COMPRESSOR_TYPES] = { false };
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			finished[i] = streams[i] && streams[i]->is_finished();
+			streams[i].reset();
+		}
+
+		if (active) {
+			std::lock_guard<std::mutex> lock(map_mutex);
+			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+				// An aborted block still took txn out of the cache, so it goes in the history too
+				if (finished[i])
+					sessions[i].add(images[i], true);
+				if (complete[i])
+					compressedBlocks.add(hash, i, images[i]);
+			}
+		}
+
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			images[i].reset();
+			complete[i] = false;
+			if (type_locks[i].owns_lock())
+				type_locks[i].unlock();
+		}
+		parser.reset();
+		active = false;
+		skip = false;
+	}
+
+	void start(const std::vector<unsigned char>& bytes) {
+		hash.resize(32);
+		getblockhash(hash, bytes, sizeof(struct bitcoin_msg_header));
+
+		bool haveClients[COMPRESSOR_TYPES] = { false };
+		{
+			std::lock_guard<std::mutex> lock(map_mutex);
+			announcer.announce(&bytes[sizeof(struct bitcoin_msg_header)], hash);
+			for (const auto& client : clientMap) {
+				int16_t type = client.second->compressor_type;
+				if (!client.second->getDisconnectFlags() && type >= 0 && compressors[type].can_abort_blocks())
+					haveClients[type] = true;
+			}
+		}
+
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+			if (haveClients[i])
+				type_locks[i] = std::unique_lock<RelayTypeLock>(typeLocks[i]);
+		{
+			std::lock_guard<std::mutex> lock(map_mutex);
+			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+				if (compressedBlocks.get(hash, i))
+					haveClients[i] = false;
+		}
+
+		// A stream is only started once the previous one has checked the header (ie BAD_WORK) without
+		// complaint, and a type which has SEEN the block is left to do_relay
+		const char* err = NULL;
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			if (!haveClients[i] || (err && strcmp(err, "SEEN")))
+				continue;
+			streams[i].reset(new BlockCompressionStream(compressors[i], check_merkle, check_merkle));
+			images[i] = std::make_shared<std::vector<unsigned char> >();
+			images[i]->reserve(1100000);
+			sent[i] = 0;
+			err = streams[i]->start(&bytes[sizeof(struct bitcoin_msg_header)], hash, parser->tx_count(), *images[i]);
+			if (err) {
+				streams[i].reset();
+				images[i].reset();
+				type_locks[i].unlock();
+			} else
+				active = true;
+		}
+
+		if (!active) {
+			reset();
+			skip = true;
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(map_mutex);
+			for (const auto& client : clientMap) {
+				Receiver r = { client.second, client.second->compressor_type };
+				if (client.second->getDisconnectFlags() || r.type < 0 || !streams[r.type])
+					continue;
+				if (client.second->begin_block_stream())
+					receivers.push_back(r);
+			}
+		}
+
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+			if (streams[i])
+				send_pending(i);
+	}
+
+public:
+	BlockCutThrough(std::mutex& map_mutex_in, std::map<std::string, RelayNetworkClient*>& clientMap_in, CompressedBlockCache& compressedBlocks_in, HeaderAnnouncer& announcer_in,
+			SessionHistory* sessions_in, RelayTypeLock* typeLocks_in, bool check_merkle_in)
+		: map_mutex(map_mutex_in), clientMap(clientMap_in), compressedBlocks(compressedBlocks_in), announcer(announcer_in), sessions(sessions_in),
+		typeLocks(typeLocks_in), check_merkle(check_merkle_in) {
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+			complete[i] = false;
+	}
+
+	// available == 0 means the read failed partway through
+	void progress(const std::vector<unsigned char>& bytes, size_t available) {
+		if (!available) {
+			abort_all();
+			reset();
+			return;
+		}
+
+		if (!parser)
+			parser.reset(new BlockStreamParser(bytes));
+		if (skip || available <= sizeof(struct bitcoin_msg_header) + 80)
+			return;
+
+		if (!active) {
+			if (!parser->read_header(available)) {
+				skip = parser->error() != NULL;
+				return;
+			}
+			start(bytes);
+			if (skip)
+				return;
+		}
+
+		// Each tx is hashed once here rather than by every stream which wants its txid
+		bool need_txids = false;
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+			if (streams[i] && streams[i]->needs_txids())
+				need_txids = true;
+
+		BlockView::TxRef tx;
+		unsigned char txid[32];
+		while (parser->next_tx(available, tx)) {
+			if (need_txids)
+				double_sha256(&bytes[tx.offset], txid, tx.length);
+			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+				if (streams[i]) {
+					streams[i]->add_tx(bytes.begin() + tx.offset, bytes.begin() + tx.offset + tx.length, *images[i], need_txids ? txid : NULL);
+					send_pending(i);
+				}
+			}
+		}
+
+		if (parser->error())
+			abort_all();
+	}
+
+	// Once this returns, do_relay takes care of the types which weren't streamed (it skips those which
+	// were, as their images are in compressedBlocks)
+	void finish() {
+		if (!active) {
+			reset();
+			return;
+		}
+
+		const char* parse_err = parser->done() ? NULL : (parser->error() ? parser->error() : "INVALID_SIZE");
+		for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+			if (!streams[i])
+				continue;
+
+			const char* err = parse_err;
+			if (err)
+				streams[i]->abort(*images[i]);
+			else
+				err = streams[i]->finish(*images[i]);
+			send_pending(i);
+
+			complete[i] = !err;
+			if (err)
+				printf(HASH_FORMAT" streaming to compressor type %u failed (%s)\n", HASH_PRINT(&hash[0]), i, err);
+		}
+
+		reset();
+	}
+};
+
+
 class MempoolClient : public OutboundPersistentConnection {
 private:
-	std::function<void(std::vector<unsigned char>)> on_hash;
+	std::function<void(std::vector<unsigned char>, uint64_t)> on_hash;
 public:
-	MempoolClient(std::string serverHostIn, uint16_t serverPortIn, std::function<void(std::vector<unsigned char>)> on_hash_in)
+	// on_hash is called with each tx's hash and fee per kB
+	MempoolClient(std::string serverHostIn, uint16_t serverPortIn, std::function<void(std::vector<unsigned char>, uint64_t)> on_hash_in)
 		: OutboundPersistentConnection(serverHostIn, serverPortIn), on_hash(on_hash_in) { construction_done(); }
 
 	void on_disconnect() {}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
+		unsigned char hello[MEMPOOL_LINK_HELLO_BYTES];
+		if (read_all((char*)hello, MEMPOOL_LINK_HELLO_BYTES, std::chrono::seconds(10)) != MEMPOOL_LINK_HELLO_BYTES)
+			return disconnect("Failed to read mempool link hello");
+		if (memcmp(hello, MEMPOOL_LINK_HELLO, MEMPOOL_LINK_HELLO_BYTES))
+			return disconnect("Mempool server speaks a different link version");
+
 		while (true) {
-			std::vector<unsigned char> hash(32);
-			if (read_all((char*)&hash[0], 32, std::chrono::seconds(10)) != 32)
+			unsigned char record[MEMPOOL_TX_RECORD_BYTES];
+			if (read_all((char*)record, MEMPOOL_TX_RECORD_BYTES, std::chrono::seconds(10)) != MEMPOOL_TX_RECORD_BYTES)
 				return disconnect("Failed to read next hash");
-			on_hash(hash);
+
+			uint64_t fee_per_kb = 0;
+			for (int i = 32; i < MEMPOOL_TX_RECORD_BYTES; i++)
+				fee_per_kb = (fee_per_kb << 8) | record[i];
+			on_hash(std::vector<unsigned char>(record, record + 32), fee_per_kb);
 		}
 	}
 
@@ -332,74 +886,170 @@ int main(const int argc, const char** argv) {
 	// the client and because that is the case we want to optimize for)
 
 	std::mutex txn_mutex;
+	// Records as sent by the mempool server (hash then fee), found by hash with lower_bound
 	vectormruset txnWaitingToBroadcast(MAX_FAS_TOTAL_SIZE);
 
-	const std::function<std::pair<const char*, size_t> (const std::vector<unsigned char>&, const std::vector<unsigned char>&, bool)> do_relay =
-		[&](const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& bytes, bool checkMerkle) {
+	// Only guarded by map_mutex
+	CompressedBlockCache compressedBlocks(8 * COMPRESSOR_TYPES);
+
+	HeaderAnnouncer announcer(clientMap);
+
+	// Only guarded by map_mutex
+	SessionHistory sessions[COMPRESSOR_TYPES];
+
+	RelayTypeLock typeLocks[COMPRESSOR_TYPES];
+
+	// Called with typeLocks[type] held, returns true if the tx went out
+	const std::function<bool (uint16_t, const std::shared_ptr<std::vector<unsigned char> >&, uint64_t)> relay_tx =
+		[&](uint16_t type, const std::shared_ptr<std::vector<unsigned char> >& bytes, uint64_t fee_per_kb) {
+			std::shared_ptr<std::vector<unsigned char> > evict;
+			auto tx = compressors[type].evicts_by_fee() ? compressors[type].get_relay_transaction(bytes, fee_per_kb, evict) : compressors[type].get_relay_transaction(bytes);
+			if (!tx.use_count())
+				return false;
+
+			std::lock_guard<std::mutex> lock(map_mutex);
+			// The eviction is a separate message in the session, so that resuming between it and
+			// the tx can't apply it twice
+			if (evict)
+				sessions[type].add(evict, false);
+			sessions[type].add(tx, false);
+			for (const auto& client : clientMap) {
+				if (!client.second->getDisconnectFlags() && client.second->compressor_type == type) {
+					if (evict)
+						client.second->receive_transaction(evict);
+					client.second->receive_transaction(tx);
+				}
+			}
+			return true;
+		};
+	for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+		typeLocks[i].set_relay_tx([&, i](const std::shared_ptr<std::vector<unsigned char> >& bytes, uint64_t fee_per_kb) { relay_tx(i, bytes, fee_per_kb); });
+
+	BlockCutThrough trustedCutThrough(map_mutex, clientMap, compressedBlocks, announcer, sessions, typeLocks, false);
+	BlockCutThrough localCutThrough(map_mutex, clientMap, compressedBlocks, announcer, sessions, typeLocks, true);
+
+	const std::function<std::pair<const char*, size_t> (const BlockView&, bool)> do_relay =
+		[&](const BlockView& block, bool checkMerkle) {
+			bool haveClients[COMPRESSOR_TYPES] = { true };
+			{
+				std::lock_guard<std::mutex> lock(map_mutex);
+				announcer.announce(block.header(), block.get_hash());
+				for (const auto& client : clientMap) {
+					int16_t type = client.second->compressor_type;
+					if (!client.second->getDisconnectFlags() && type >= 0)
+						haveClients[type] = true;
+				}
+			}
+
+			// compressors[0] always runs, and runs first, as it does the sanity checks and keeps track
+			// of SEEN for the callers: nothing else is compressed or sent for a block it rejects
+			std::unique_lock<RelayTypeLock> type_locks[COMPRESSOR_TYPES];
+			type_locks[0] = std::unique_lock<RelayTypeLock>(typeLocks[0]);
+			std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> results[COMPRESSOR_TYPES];
+			results[0] = compressors[0].maybe_compress_block(block, checkMerkle);
+			if (std::get<1>(results[0]))
+				return std::make_pair(std::get<1>(results[0]), (size_t)0);
+
+			// The rest only bother if someone is around to receive the result, and it hasn't already
+			// been streamed to them
+			for (uint16_t i = 1; i < COMPRESSOR_TYPES; i++)
+				type_locks[i] = std::unique_lock<RelayTypeLock>(typeLocks[i]);
+			std::vector<uint16_t> types;
+			{
+				std::lock_guard<std::mutex> lock(map_mutex);
+				for (uint16_t i = 1; i < COMPRESSOR_TYPES; i++) {
+					if (haveClients[i] && !compressedBlocks.get(block.get_hash(), i))
+						types.push_back(i);
+					else
+						results[i] = std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "SEEN");
+				}
+			}
+
+			// A type nobody is listening on still has to forget the block's txn, or relay_node_connected
+			// would replay already-mined txn to its next client
+			for (uint16_t i = 1; i < COMPRESSOR_TYPES; i++)
+				if (!haveClients[i])
+					compressors[i].block_mined(block);
+
+			// Only worth other threads if there is more than one to do, the first runs on this one
+			std::future<std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> > futures[COMPRESSOR_TYPES];
+			for (size_t j = 1; j < types.size(); j++)
+				futures[types[j]] = std::async(std::launch::async, [&, j]() { return compressors[types[j]].maybe_compress_block(block, checkMerkle); });
+			if (!types.empty())
+				results[types[0]] = compressors[types[0]].maybe_compress_block(block, checkMerkle);
+			for (size_t j = 1; j < types.size(); j++)
+				results[types[j]] = futures[types[j]].get();
+
+			// Declared after type_locks, so it is released before they are
 			std::lock_guard<std::mutex> lock(map_mutex);
-			size_t ret;
 			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
-				auto tuple = compressors[i].maybe_compress_block(fullhash, bytes, checkMerkle);
-				const char* insane = std::get<1>(tuple);
-				if (!insane) {
-					auto block = std::get<0>(tuple);
-					for (const auto& client : clientMap) {
-						if (!client.second->getDisconnectFlags() && client.second->compressor_type == i)
-							client.second->receive_block(block);
-					}
-					if (i == 0)
-						ret = block->size();
-				} else
-					return std::make_pair(insane, (size_t)0);
+				if (!std::get<1>(results[i])) {
+					compressedBlocks.add(block.get_hash(), i, std::get<0>(results[i]));
+					sessions[i].add(std::get<0>(results[i]), true);
+				}
+				else if (strcmp(std::get<1>(results[i]), "SEEN"))
+					printf(HASH_FORMAT" compressor type %u failed (%s) where type 0 did not\n", HASH_PRINT(&block.get_hash()[0]), i, std::get<1>(results[i]));
 			}
-			return std::make_pair((const char*)0, ret);
+
+			for (const auto& client : clientMap) {
+				int16_t type = client.second->compressor_type;
+				if (client.second->getDisconnectFlags() || type < 0 || std::get<1>(results[type]))
+					continue;
+				client.second->receive_block(compressedBlocks.get(block.get_hash(), type));
+			}
+
+			return std::make_pair((const char*)0, std::get<0>(results[0])->size());
 		};
 
 	trustedP2P = new P2PClient(argv[1], std::stoul(argv[2]),
-					[&](std::vector<unsigned char>& bytes,  const std::chrono::system_clock::time_point& read_start) {
-						if (bytes.size() < sizeof(struct bitcoin_msg_header) + 80)
+					[&](const std::shared_ptr<std::vector<unsigned char> >& bytes, const std::chrono::system_clock::time_point& read_start) {
+						trustedCutThrough.finish();
+
+						if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
 							return;
 
 						std::chrono::system_clock::time_point send_start(std::chrono::system_clock::now());
 
-						std::vector<unsigned char> fullhash(32);
-						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
+						BlockView block(bytes);
+						const std::vector<unsigned char>& fullhash = block.get_hash();
 
-						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, false);
+						std::pair<const char*, size_t> relay_res = do_relay(block, false);
 						if (relay_res.first) {
 							printf(HASH_FORMAT" INSANE %s TRUSTEDP2P\n", HASH_PRINT(&fullhash[0]), relay_res.first);
 							return;
 						} else
-							localP2P->receive_block(bytes);
+							localP2P->receive_block(block);
 
 						std::chrono::system_clock::time_point send_end(std::chrono::system_clock::now());
 						printf(HASH_FORMAT" BLOCK %lu %s TRUSTEDP2P %lu / %lu / %lu TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]), epoch_millis_lu(send_start), argv[1],
-														bytes.size(), relay_res.second, bytes.size(),
+														bytes->size(), relay_res.second, bytes->size(),
 														to_millis_double(send_start - read_start), to_millis_double(send_end - send_start));
 					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 						std::vector<unsigned char> hash(32);
 						double_sha256(&(*bytes)[0], &hash[0], bytes->size());
+						uint64_t fee_per_kb = 0;
 						{
 							std::lock_guard<std::mutex> lock(txn_mutex);
-							if (txnWaitingToBroadcast.find(hash) == txnWaitingToBroadcast.end())
+							auto it = txnWaitingToBroadcast.lower_bound(hash);
+							if (it == txnWaitingToBroadcast.end() || memcmp(&(*it)[0], &hash[0], 32))
 								return;
+							for (int i = 32; i < MEMPOOL_TX_RECORD_BYTES; i++)
+								fee_per_kb = (fee_per_kb << 8) | (*it)[i];
 						}
-						std::lock_guard<std::mutex> lock(map_mutex);
-						bool sentToLocal = false;
+						// A type which is busy streaming a block gets the tx once it is done, which
+						// is assumed to relay it
+						bool relayed = false;
 						for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
-							auto tx = compressors[i].get_relay_transaction(bytes);
-							if (tx.use_count()) {
-								for (const auto& client : clientMap) {
-									if (!client.second->getDisconnectFlags() && client.second->compressor_type == i)
-										client.second->receive_transaction(tx);
-								}
-								if (!sentToLocal) {
-									localP2P->receive_transaction(bytes);
-									sentToLocal = true;
-								}
-							}
+							if (typeLocks[i].try_lock_or_queue(bytes, fee_per_kb)) {
+								std::unique_lock<RelayTypeLock> type_lock(typeLocks[i], std::adopt_lock);
+								if (relay_tx(i, bytes, fee_per_kb))
+									relayed = true;
+							} else
+								relayed = true;
 						}
+						if (relayed)
+							localP2P->receive_transaction(bytes);
 					},
 					[&](std::vector<unsigned char>& headers) {
 						try {
@@ -419,83 +1069,128 @@ int main(const int argc, const char** argv) {
 
 							printf("Added headers from trusted peers, seen %u blocks\n", compressors[0].blocks_sent());
 						} catch (read_exception) { }
-					}, true);
+					}, true,
+					[&](const std::vector<unsigned char>& bytes, size_t available) {
+						trustedCutThrough.progress(bytes, available);
+					});
 
 	MempoolClient mempoolClient(argv[1], std::stoul(argv[3]),
-					[&](std::vector<unsigned char> txn) {
+					[&](std::vector<unsigned char> txn, uint64_t fee_per_kb) {
 						std::lock_guard<std::mutex> lock(map_mutex);
 						if (!compressors[0].was_tx_sent(&txn[0])) {
 							std::lock_guard<std::mutex> lock(txn_mutex);
-							txnWaitingToBroadcast.insert(txn);
+							std::vector<unsigned char> record(txn);
+							for (int i = 7; i >= 0; i--)
+								record.push_back((fee_per_kb >> (8 * i)) & 0xff);
+							txnWaitingToBroadcast.insert(record);
 							trustedP2P->request_transaction(txn);
 						}
 					});
 
 	localP2P = new P2PClient("127.0.0.1", 8335,
-					[&](std::vector<unsigned char>& bytes, const std::chrono::system_clock::time_point& read_start) {
-						if (bytes.size() < sizeof(struct bitcoin_msg_header) + 80)
+					[&](const std::shared_ptr<std::vector<unsigned char> >& bytes, const std::chrono::system_clock::time_point& read_start) {
+						localCutThrough.finish();
+
+						if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
 							return;
 
 						std::chrono::system_clock::time_point send_start(std::chrono::system_clock::now());
 
-						std::vector<unsigned char> fullhash(32);
-						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
+						BlockView block(bytes);
+						const std::vector<unsigned char>& fullhash = block.get_hash();
 
-						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, true);
+						std::pair<const char*, size_t> relay_res = do_relay(block, true);
 						if (relay_res.first) {
 							printf(HASH_FORMAT" INSANE %s LOCALP2P\n", HASH_PRINT(&fullhash[0]), relay_res.first);
 							return;
 						} else
-							localP2P->receive_block(bytes);
+							localP2P->receive_block(block);
 
-						trustedP2P->receive_block(bytes);
+						trustedP2P->receive_block(block);
 
 						std::chrono::system_clock::time_point send_end(std::chrono::system_clock::now());
 						printf(HASH_FORMAT" BLOCK %lu %s LOCALP2P %lu / %lu / %lu TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]),
 														epoch_millis_lu(send_start), "127.0.0.1",
-														bytes.size(), relay_res.second, bytes.size(),
+														bytes->size(), relay_res.second, bytes->size(),
 														to_millis_double(send_start - read_start), to_millis_double(send_end - send_start));
 					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 						trustedP2P->receive_transaction(bytes);
-					}, NULL, false);
+					}, NULL, false,
+					[&](const std::vector<unsigned char>& bytes, size_t available) {
+						localCutThrough.progress(bytes, available);
+					});
 
 	std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)> relayBlock =
 		[&](RelayNetworkClient* from, std::shared_ptr<std::vector<unsigned char>> & bytes, const std::vector<unsigned char>& fullhash) {
 			if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
 				return (size_t)0;
 
-			std::pair<const char*, size_t> relay_res = do_relay(fullhash, *bytes, false);
+			BlockView block(bytes, fullhash, true);
+
+			std::pair<const char*, size_t> relay_res = do_relay(block, false);
 			if (relay_res.first) {
 				printf(HASH_FORMAT" INSANE %s UNTRUSTEDRELAY %s\n", HASH_PRINT(&fullhash[0]), relay_res.first, from->host.c_str());
 				return relay_res.second;
 			} else
-				localP2P->receive_block(*bytes);
+				localP2P->receive_block(block);
 
-			trustedP2P->receive_block(*bytes);
+			trustedP2P->receive_block(block);
 
 			return relay_res.second;
 		};
 
+	std::function<void (RelayNetworkClient*, const unsigned char*, const std::vector<unsigned char>&)> relayHeader =
+		[&](RelayNetworkClient* from, const unsigned char* header, const std::vector<unsigned char>& fullhash) {
+			{
+				std::lock_guard<std::mutex> lock(map_mutex);
+				announcer.announce(header, fullhash);
+			}
+			localP2P->receive_header(header);
+			trustedP2P->receive_header(header);
+		};
+
 	std::function<void (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&)> relayTx =
 		[&](RelayNetworkClient* from, std::shared_ptr<std::vector<unsigned char>> & bytes) {
 			trustedP2P->receive_transaction(bytes);
 		};
 
-	std::function<void (RelayNetworkClient*, int token)> connected =
-		[&](RelayNetworkClient* client, int token) {
+	// Both of these take the client's type lock before its send mutex, so that a block being streamed
+	// to its type holds up only this client, which then gets the cache as it is after the block
+	std::function<void (RelayNetworkClient*)> connected =
+		[&](RelayNetworkClient* client) {
 			assert(client->compressor_type >= 0 && client->compressor_type < COMPRESSOR_TYPES);
+			std::lock_guard<RelayTypeLock> type_lock(typeLocks[client->compressor_type]);
+			int token = client->begin_session();
 			compressors[client->compressor_type].relay_node_connected(client, token);
+			client->end_session(token);
+		};
+
+	std::function<void (RelayNetworkClient*, uint64_t, uint64_t)> resumeSession =
+		[&](RelayNetworkClient* client, uint64_t session_id, uint64_t seq) {
+			assert(client->compressor_type >= 0 && client->compressor_type < COMPRESSOR_TYPES);
+			std::lock_guard<RelayTypeLock> type_lock(typeLocks[client->compressor_type]);
+			std::lock_guard<std::mutex> lock(map_mutex);
+			sessions[client->compressor_type].resume(client, compressors[client->compressor_type], session_id, seq);
 		};
 
 	std::thread([&](void) {
+		unsigned int ticks = 0;
 		while (true) {
 			std::this_thread::sleep_for(std::chrono::seconds(10)); // Implicit new-connection rate-limit
+			if (++ticks % 360 == 0) {
+				for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
+					char name[32];
+					sprintf(name, "SEND TYPE %u", i);
+					compressors[i].get_send_stats().print(name);
+				}
+			}
 			{
 				std::lock_guard<std::mutex> lock(map_mutex);
 				for (auto it = clientMap.begin(); it != clientMap.end();) {
-					if (it->second->getDisconnectFlags() & DISCONNECT_COMPLETE) {
+					if ((it->second->getDisconnectFlags() & DISCONNECT_COMPLETE) && !it->second->is_block_streaming()) {
 						fprintf(stderr, "%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
+						it->second->get_recv_stats().print(it->first.c_str());
 						delete it->second;
 						clientMap.erase(it++);
 					} else
@@ -540,7 +1235,7 @@ int main(const int argc, const char** argv) {
 			if (whitelist)
 				host += ":" + std::to_string(addr.sin6_port);
 			assert(clientMap.count(host) == 0);
-			clientMap[host] = new RelayNetworkClient(new_fd, host, relayBlock, relayTx, connected);
+			clientMap[host] = new RelayNetworkClient(new_fd, host, relayBlock, relayHeader, relayTx, connected, resumeSession);
 			fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
 		}
 	}
@@ -1,12 +1,16 @@
 #include "utils.h"
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
+#include "mruset.h"
 #include "relayprocess.h"
+#include "blockview.h"
 
 #include <stdio.h>
 #include <sys/time.h>
 #include <algorithm>
+#include <deque>
 #include <random>
+#include <set>
 #include <string.h>
 #include <unistd.h>
 
@@ -93,28 +97,35 @@ std::shared_ptr<std::vector<unsigned char> > __attribute__((noinline)) recv_bloc
 	return std::get<1>(res);
 }
 
-std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> __attribute__((noinline)) do_compress_test(RelayNodeCompressor& sender, const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& data, uint32_t tx_count) {
+bool block_matches(const std::vector<unsigned char>& decompressed, const std::vector<unsigned char>& data) {
+	// decompress_relay_block fills in the P2P message header, data only has space for one
+	std::vector<unsigned char> expected(data);
+	prepare_message("block", &expected[0], expected.size() - sizeof(struct bitcoin_msg_header));
+	return decompressed == expected;
+}
+
+std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> __attribute__((noinline)) do_compress_test(RelayNodeCompressor& sender, const BlockView& block, uint32_t tx_count) {
 	auto start = std::chrono::steady_clock::now();
-	auto res = sender.maybe_compress_block(fullhash, data, true);
+	auto res = sender.maybe_compress_block(block, true);
 	auto compressed = std::chrono::steady_clock::now();
 	total_compress_time += compressed - start; compress_runs++;
 	if ((compressed - start) > max_compress_time) max_compress_time = compressed - start;
 	if ((compressed - start) < min_compress_time) min_compress_time = compressed - start;
 	if(std::get<0>(res))
-		PRINT_TIME("Compressed from %lu to %lu in %lf ms with %u txn pre-relayed\n", data.size(), std::get<0>(res)->size(), to_millis_double(compressed - start), tx_count);
+		PRINT_TIME("Compressed from %lu to %lu in %lf ms with %u txn pre-relayed\n", block.bytes().size(), std::get<0>(res)->size(), to_millis_double(compressed - start), tx_count);
 	return res;
 }
 
 void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shared_ptr<std::vector<unsigned char> > > txVectors) {
-	std::vector<unsigned char> fullhash(32);
-	getblockhash(fullhash, data, sizeof(struct bitcoin_msg_header));
+	BlockView block(data);
+	const std::vector<unsigned char>& fullhash = block.get_hash();
 
 	RelayNodeCompressor sender(false), tester(false), tester2(false), receiver(false);
 
 	for (auto v : txVectors) {
 		unsigned int made = sender.get_relay_transaction(v).use_count();
 #ifndef PRECISE_BENCH
-		v = std::make_shared<std::vector<unsigned char> >(*v); // Copy the vector to give the deduper something to do
+		v = std::make_shared<std::vector<unsigned char> >(*v); // Copy the vector so that the caches have to intern it
 #endif
 		if (made)
 			receiver.recv_tx(v);
@@ -142,21 +153,21 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 			printf("for_each_sent_tx was not in order!\n");
 			exit(6);
 		}
-		std::vector<unsigned char> tx_data, tx_hash(32);
-		if (!tester.send_tx_cache.remove(0, tx_data, &tx_hash[0]) || tx_data != *txVectors[i++]) {
+		std::shared_ptr<std::vector<unsigned char> > tx_data;
+		std::vector<unsigned char> tx_hash(32);
+		if (!tester.send_tx_cache.remove(0, tx_data, &tx_hash[0]) || *tx_data != *txVectors[i++]) {
 			printf("for_each_sent_tx output did not match remove(0)\n");
 			exit(7);
 		}
 	});
 
-	auto res = do_compress_test(sender, fullhash, data, txVectors.size());
+	auto res = do_compress_test(sender, block, txVectors.size());
 
 	if (std::get<1>(res)) {
 		printf("Failed to compress block %s\n", std::get<1>(res));
 		exit(8);
 	}
-	std::this_thread::sleep_for(std::chrono::milliseconds(10)); // Let the deduper thread run...
-	if (*std::get<0>(tester2.maybe_compress_block(fullhash, data, true)) != *std::get<0>(res)) {
+	if (*std::get<0>(tester2.maybe_compress_block(block, true)) != *std::get<0>(res)) {
 		printf("maybe_compress_block not consistent???\n");
 		exit(9);
 	}
@@ -167,20 +178,20 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 
 	auto decompressed_block = recv_block(std::get<0>(res), &receiver, true);
 
-	if (*decompressed_block != data) {
+	if (!block_matches(*decompressed_block, data)) {
 		printf("Re-constructed block did not match!\n");
 		exit(4);
 	}
 
 	if (globalSeenSet.insert(fullhash).second) {
-		res = global_sender.maybe_compress_block(fullhash, data, true);
+		res = global_sender.maybe_compress_block(block, true);
 		if (std::get<1>(res)) {
 			printf("Failed to compress block globally %s\n", std::get<1>(res));
 			exit(8);
 		}
 		decompressed_block = recv_block(std::get<0>(res), &global_receiver, false);
 
-		if (*decompressed_block != data) {
+		if (!block_matches(*decompressed_block, data)) {
 			printf("Global re-constructed block did not match!\n");
 			exit(4);
 		}
@@ -203,13 +214,903 @@ void run_test(std::vector<unsigned char>& data) {
 	test_compress_block(data, txVectors);
 }
 
+/*******************************
+ **** Synthetic block tests ****
+ *******************************/
+// block.txt is old, mostly P2PKH, blocks relayed with the original protocol. These make up txn and
+// blocks to run each later protocol version's encodings and messages through a pair of compressors.
+
+std::vector<std::vector<unsigned char> > test_txids;
+
+void push_random(std::vector<unsigned char>& v, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		v.push_back(engine() & 0xff);
+}
+
+void push_le32(std::vector<unsigned char>& v, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		v.push_back((value >> (8 * i)) & 0xff);
+}
+
+// kind 0-3 are the templates encode_tx knows (P2PKH, P2SH, P2WPKH, P2WSH), the rest OP_RETURNs of
+// up to pad bytes, which encode_tx has to send raw
+void push_output_script(std::vector<unsigned char>& tx, int kind, size_t pad) {
+	if (kind == 0) {
+		tx.insert(tx.end(), {25, 0x76, 0xa9, 0x14});
+		push_random(tx, 20);
+		tx.insert(tx.end(), {0x88, 0xac});
+	} else if (kind == 1) {
+		tx.insert(tx.end(), {23, 0xa9, 0x14});
+		push_random(tx, 20);
+		tx.push_back(0x87);
+	} else if (kind == 2) {
+		tx.insert(tx.end(), {22, 0x00, 0x14});
+		push_random(tx, 20);
+	} else if (kind == 3) {
+		tx.insert(tx.end(), {34, 0x00, 0x20});
+		push_random(tx, 32);
+	} else {
+		uint32_t len = pad ? pad : engine() % 80;
+		std::vector<unsigned char> script_len = varint(len + 1);
+		tx.insert(tx.end(), script_len.begin(), script_len.end());
+		tx.push_back(0x6a);
+		push_random(tx, len);
+	}
+}
+
+// A tx with a mix of the scriptSigs, sequences and outputs encode_tx has special cases for, which
+// spends outputs of earlier made-up txn about half the time. pad makes it at least that many bytes.
+std::shared_ptr<std::vector<unsigned char> > make_test_tx(size_t pad=0) {
+	static const uint32_t sequences[] = { 0xffffffff, 0xfffffffe, 0xfffffffd, 0x12345 };
+	auto tx = std::make_shared<std::vector<unsigned char> >();
+	push_le32(*tx, 1 + engine() % 2);
+
+	uint32_t ins = 1 + engine() % 3;
+	tx->push_back(ins);
+	for (uint32_t i = 0; i < ins; i++) {
+		if (!test_txids.empty() && engine() % 2) {
+			const std::vector<unsigned char>& txid = test_txids[test_txids.size() - 1 - engine() % std::min(test_txids.size(), size_t(500))];
+			tx->insert(tx->end(), txid.begin(), txid.end());
+		} else
+			push_random(*tx, 32);
+		push_le32(*tx, engine() % 4);
+
+		if (engine() % 3) {
+			// <sig> <compressed pubkey>
+			uint32_t sig_len = 70 + engine() % 4;
+			tx->push_back(sig_len + 35);
+			tx->push_back(sig_len);
+			push_random(*tx, sig_len);
+			tx->push_back(33);
+			tx->push_back(2 + engine() % 2);
+			push_random(*tx, 32);
+		} else {
+			uint32_t script_len = engine() % 120;
+			tx->push_back(script_len);
+			push_random(*tx, script_len);
+		}
+		push_le32(*tx, sequences[engine() % 4]);
+	}
+
+	uint32_t outs = 1 + engine() % 3 + (pad != 0);
+	tx->push_back(outs);
+	for (uint32_t i = 0; i < outs; i++) {
+		push_random(*tx, 8);
+		push_output_script(*tx, pad && i == 0 ? 4 : engine() % 5, pad);
+	}
+	push_le32(*tx, engine() % 2 ? 0 : engine());
+
+	std::vector<unsigned char> txid(32);
+	double_sha256(&(*tx)[0], &txid[0], tx->size());
+	test_txids.push_back(txid);
+	return tx;
+}
+
+// A block (with space for a bitcoin_msg_header in front) of txn, with a correct merkle root
+std::vector<unsigned char> make_test_block(const std::vector<std::shared_ptr<std::vector<unsigned char> > >& txn) {
+	std::vector<unsigned char> block(sizeof(struct bitcoin_msg_header));
+	push_le32(block, 4);
+	push_random(block, 32);
+
+	std::vector<unsigned char> hashes;
+	for (const std::shared_ptr<std::vector<unsigned char> >& tx : txn) {
+		unsigned char txid[32];
+		double_sha256(&(*tx)[0], txid, tx->size());
+		hashes.insert(hashes.end(), txid, txid + 32);
+	}
+	while (hashes.size() > 32) {
+		if ((hashes.size() / 32) % 2)
+			hashes.insert(hashes.end(), hashes.end() - 32, hashes.end());
+		std::vector<unsigned char> level;
+		for (size_t i = 0; i < hashes.size(); i += 64) {
+			unsigned char hash[32];
+			double_sha256_two_32_inputs(&hashes[i], &hashes[i + 32], hash);
+			level.insert(level.end(), hash, hash + 32);
+		}
+		hashes.swap(level);
+	}
+	block.insert(block.end(), hashes.begin(), hashes.end());
+	push_random(block, 12);
+
+	std::vector<unsigned char> txcount = varint(txn.size());
+	block.insert(block.end(), txcount.begin(), txcount.end());
+	for (const std::shared_ptr<std::vector<unsigned char> >& tx : txn)
+		block.insert(block.end(), tx->begin(), tx->end());
+	return block;
+}
+
+void test_caches_match(RelayNodeCompressor& sender, RelayNodeCompressor& receiver, const char* test) {
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > sent, recvd, sent_recent, recvd_recent;
+	sender.send_tx_cache.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { sent.push_back(tx); });
+	receiver.recv_tx_cache.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { recvd.push_back(tx); });
+	sender.send_recent_txn.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { sent_recent.push_back(tx); });
+	receiver.recv_recent_txn.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { recvd_recent.push_back(tx); });
+
+	bool match = sent.size() == recvd.size() && sent_recent.size() == recvd_recent.size();
+	for (size_t i = 0; match && i < sent.size(); i++)
+		match = *sent[i] == *recvd[i];
+	for (size_t i = 0; match && i < sent_recent.size(); i++)
+		match = *sent_recent[i] == *recvd_recent[i];
+	if (!match) {
+		printf("%s: caches out of sync (%lu/%lu cached, %lu/%lu recent)\n", test, (unsigned long)sent.size(), (unsigned long)recvd.size(),
+				(unsigned long)sent_recent.size(), (unsigned long)recvd_recent.size());
+		exit(10);
+	}
+}
+
+// Applies messages from a relay server to its compressor the way RelayNetworkClient does, counting
+// each one towards its place in the server's relay session
+class TestRelayClient {
+	RELAY_DECLARE_CLASS_VARS
+public:
+	RelayNodeCompressor compressor;
+	uint64_t session_seq;
+	uint32_t blocks_aborted;
+
+	TestRelayClient(bool useShortIds, bool useTxCoding)
+		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, compressor(false, useShortIds, useTxCoding), session_seq(0), blocks_aborted(0) {}
+
+	// Returns the block, restored tx or block header, if msg is one, exits on any error
+	std::shared_ptr<std::vector<unsigned char> > apply(const std::vector<unsigned char>& msg, const char* test) {
+		struct relay_msg_header header;
+		memcpy(&header, &msg[0], sizeof(header));
+		uint32_t message_size = ntohl(header.length);
+		std::vector<unsigned char> data(msg.begin() + sizeof(header), msg.end());
+		std::shared_ptr<std::vector<unsigned char> > res;
+		const char* err = NULL;
+
+		if (header.type == BLOCK_TYPE) {
+			size_t readpos = 0;
+			std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) {
+				if (readpos + count > data.size())
+					return ssize_t(-1);
+				memcpy(buf, &data[readpos], count);
+				readpos += count;
+				return ssize_t(count);
+			};
+			auto decompressed = compressor.decompress_relay_block(do_read, message_size, false);
+			err = std::get<2>(decompressed);
+			if (err && !strcmp(err, "ABORTED")) {
+				blocks_aborted++;
+				err = NULL;
+			} else if (!err && readpos != data.size())
+				err = "block message had trailing data";
+			res = std::get<1>(decompressed);
+		} else if (header.type == TRANSACTION_TYPE) {
+			if (message_size != data.size() || !compressor.maybe_recv_tx_of_size(message_size, false))
+				err = "bad transaction message";
+			else
+				compressor.recv_tx(std::make_shared<std::vector<unsigned char> >(data));
+		} else if (header.type == RECENT_TRANSACTION_TYPE)
+			compressor.recv_recent_tx(std::make_shared<std::vector<unsigned char> >(data));
+		else if (header.type == RESTORE_TYPE)
+			err = compressor.recv_restore(data, res);
+		else if (header.type == EVICT_TYPE)
+			err = compressor.recv_evict(data);
+		else if (header.type == BLOCK_HEADER_TYPE) {
+			std::vector<unsigned char> fullhash(32);
+			if (message_size != 80 || data.size() != 80)
+				err = "bad block header message";
+			else {
+				getblockhash(fullhash, data, 0);
+				if (!check_header_work(&data[0], fullhash))
+					err = "block header did not meet its target";
+			}
+		} else
+			err = "unexpected message type";
+
+		if (err) {
+			printf("%s: client failed to apply message %s\n", test, err);
+			exit(11);
+		}
+		// Headers are sent outside the relay session
+		if (header.type == BLOCK_HEADER_TYPE)
+			return std::make_shared<std::vector<unsigned char> >(data);
+		session_seq++;
+		return res;
+	}
+};
+
+std::shared_ptr<std::vector<unsigned char> > compress_test_block(RelayNodeCompressor& sender, const std::vector<unsigned char>& block, const char* test) {
+	BlockView view(block);
+	auto res = sender.maybe_compress_block(view, false);
+	if (std::get<1>(res)) {
+		printf("%s: failed to compress block %s\n", test, std::get<1>(res));
+		exit(12);
+	}
+	return std::get<0>(res);
+}
+
+// Sends block from sender to client, returning its size on the wire
+size_t test_block_roundtrip(RelayNodeCompressor& sender, TestRelayClient& client, const std::vector<unsigned char>& block, const char* test) {
+	std::shared_ptr<std::vector<unsigned char> > msg = compress_test_block(sender, block, test);
+	std::shared_ptr<std::vector<unsigned char> > decompressed = client.apply(*msg, test);
+	if (!decompressed || !block_matches(*decompressed, block)) {
+		printf("%s: re-constructed block did not match\n", test);
+		exit(13);
+	}
+	return msg->size();
+}
+
+// Relays a new tx from sender to client, as the server would to a client of sender's version
+std::shared_ptr<std::vector<unsigned char> > relay_test_tx(RelayNodeCompressor& sender, TestRelayClient& client, size_t pad=0) {
+	std::shared_ptr<std::vector<unsigned char> > tx = make_test_tx(pad);
+	if (sender.get_relay_transaction(tx).use_count())
+		client.apply(*sender.tx_to_msg(tx), "relay tx");
+	return tx;
+}
+
+// Checks set against a std::set kept the way hashmruset is meant to behave: a ring of nMaxSize
+// insertions, each new one overwriting the oldest (which evicts it unless it was erased since)
+class TestMruReference {
+public:
+	hashmruset set;
+	std::set<std::vector<unsigned char> > ref;
+	std::deque<std::vector<unsigned char> > ring;
+	std::vector<std::vector<unsigned char> > all;
+	uint32_t max_size;
+
+	TestMruReference(uint32_t max_sizeIn) : set(max_sizeIn), max_size(max_sizeIn) {}
+
+	void insert(const std::vector<unsigned char>& hash) {
+		bool added = !ref.count(hash);
+		if (added) {
+			if (ring.size() == max_size) {
+				ref.erase(ring.front());
+				ring.pop_front();
+			}
+			ring.push_back(hash);
+			ref.insert(hash);
+		}
+		if (set.insert(hash) != added)
+			fail("insert disagreed");
+	}
+
+	void erase(const std::vector<unsigned char>& hash) {
+		bool present = ref.erase(hash);
+		if (present)
+			*std::find(ring.begin(), ring.end(), hash) = std::vector<unsigned char>();
+		if (set.erase(hash) != present)
+			fail("erase disagreed");
+	}
+
+	std::vector<unsigned char> insert_new() {
+		std::vector<unsigned char> hash;
+		push_random(hash, 32);
+		all.push_back(hash);
+		insert(hash);
+		return hash;
+	}
+
+	void check() {
+		if (set.size() != ref.size())
+			fail("size disagreed");
+		for (const std::vector<unsigned char>& hash : all)
+			if (set.count(hash) != ref.count(hash))
+				fail("count disagreed");
+	}
+
+	void fail(const char* what) {
+		printf("hashmruset: %s\n", what);
+		exit(21);
+	}
+};
+
+void test_hashmruset() {
+	TestMruReference mru(1000);
+
+	// Past nMaxSize, oldest first
+	for (int i = 0; i < 2500; i++)
+		mru.insert_new();
+	mru.check();
+
+	// Erase then reinsert, so erased ring slots and re-added hashes have to be told apart (including
+	// by the rebuilds which happen along the way)
+	for (int round = 0; round < 100; round++) {
+		for (int i = 0; i < 50; i++) {
+			const std::vector<unsigned char> hash = mru.all[mru.all.size() - 1 - engine() % 1000];
+			mru.erase(hash);
+			if (engine() % 2)
+				mru.insert(hash);
+		}
+		for (int i = 0; i < 30; i++)
+			mru.insert_new();
+		mru.check();
+	}
+
+	// Emptying it and filling it again leaves the table full of tombstones, which only a rebuild clears
+	for (int round = 0; round < 5; round++) {
+		for (const std::vector<unsigned char>& hash : mru.all)
+			mru.erase(hash);
+		mru.check();
+		for (int i = 0; i < 1000; i++)
+			mru.insert_new();
+		mru.check();
+	}
+}
+
+// remove_batch has to leave a set, and report each element, exactly as a remove() per element would
+void test_remove_batch() {
+	for (int round = 0; round < 10; round++) {
+		FlaggedArraySet seq(2000, uint32_t(-1)), batch(2000, uint32_t(-1));
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		for (int i = 0; i < 1500; i++) {
+			txn.push_back(std::make_shared<std::vector<unsigned char> >());
+			push_random(*txn.back(), 60 + engine() % 200);
+			uint32_t flag = engine() % 2;
+			seq.add(txn.back(), flag);
+			batch.add(txn.back(), flag);
+		}
+
+		// Some cached, some not, and some twice
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > remove;
+		for (int i = 0; i < 400; i++) {
+			if (engine() % 10 == 0) {
+				remove.push_back(std::make_shared<std::vector<unsigned char> >());
+				push_random(*remove.back(), 100);
+			} else if (engine() % 20 == 0 && !remove.empty())
+				remove.push_back(remove[engine() % remove.size()]);
+			else
+				remove.push_back(txn[engine() % txn.size()]);
+		}
+
+		std::vector<std::pair<std::vector<unsigned char>::const_iterator, std::vector<unsigned char>::const_iterator> > elems;
+		for (const std::shared_ptr<std::vector<unsigned char> >& tx : remove)
+			elems.emplace_back(tx->begin(), tx->end());
+		std::vector<int> indexes;
+		std::vector<unsigned char> hashes(32 * elems.size());
+		batch.remove_batch(elems, indexes, &hashes[0]);
+
+		bool match = indexes.size() == remove.size();
+		for (size_t i = 0; match && i < remove.size(); i++) {
+			unsigned char hash[32];
+			int index = seq.remove(remove[i]->begin(), remove[i]->end(), hash);
+			match = index == indexes[i] && (index < 0 || !memcmp(hash, &hashes[32 * i], 32));
+		}
+
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > seq_left, batch_left;
+		seq.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { seq_left.push_back(tx); });
+		batch.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { batch_left.push_back(tx); });
+		if (!match || seq_left != batch_left || seq.flagCount() != batch.flagCount()) {
+			printf("remove batch: did not match sequential removes\n");
+			exit(22);
+		}
+	}
+}
+
+// Headers are only announced if check_header_work accepts them, and clients have to be able to
+// check them again from the message header_to_msg builds
+void test_header_announce() {
+	std::vector<unsigned char> header, hash(32);
+	hex_str_to_reverse_vector("0100000081cd02ab7e569e8bcd9317e2fe99f2de44d49ab2b8851ba4a308000000000000e320b6c2fffc8d7504"
+			"23db8b1eb942ae710e951ed797f7affc8892b0f1fc122bc7f5d74df2b9441a42a14695", header);
+	std::reverse(header.begin(), header.end());
+
+	// Block 125552 meets its target
+	getblockhash(hash, header, 0);
+	if (!check_header_work(&header[0], hash)) {
+		printf("header announce: real header rejected\n");
+		exit(23);
+	}
+	RelayNodeCompressor compressor(false);
+	TestRelayClient client(false, false);
+	std::shared_ptr<std::vector<unsigned char> > received = client.apply(*compressor.header_to_msg(&header[0]), "header announce");
+	if (*received != header || client.session_seq) {
+		printf("header announce: client did not get the header\n");
+		exit(23);
+	}
+
+	// Its hash (about 0x1e8d68 << 168) is under 0x44b9f2 << 168 but not 0x44b9f2 << 160, and changing the
+	// nonce gives a hash with nowhere near enough work
+	header[75] = 0x18;
+	bool easier = check_header_work(&header[0], hash);
+	header[75] = 0x17;
+	bool harder = check_header_work(&header[0], hash);
+	header[75] = 0x1a;
+	header[79] ^= 1;
+	getblockhash(hash, header, 0);
+	if (!easier || harder || check_header_work(&header[0], hash)) {
+		printf("header announce: header checked against the wrong target\n");
+		exit(23);
+	}
+}
+
+void test_tx_coding() {
+	// Txids made from here on are found by lookup as block txn or short ids, depending on their index
+	size_t first_ref = test_txids.size();
+	auto txid_index = [&](const unsigned char* txid) {
+		for (size_t i = first_ref; i < test_txids.size(); i++)
+			if (!memcmp(&test_txids[i][0], txid, 32))
+				return i;
+		return size_t(0);
+	};
+	tx_prevout_lookup lookup = [&](const unsigned char* txid, uint64_t& ref) {
+		size_t i = txid_index(txid);
+		if (!i || i % 3 == 0)
+			return int(TX_PREVOUT_TXID);
+		ref = i % 3 == 1 ? i : (i << 8) | 0x42;
+		return int(i % 3 == 1 ? TX_PREVOUT_BLOCK_TX : TX_PREVOUT_SHORT_ID);
+	};
+	tx_prevout_resolve resolve = [&](int kind, uint64_t ref, unsigned char* txid) {
+		if (kind == TX_PREVOUT_SHORT_ID && (ref & 0xff) == 0x42)
+			ref >>= 8;
+		else if (kind != TX_PREVOUT_BLOCK_TX)
+			return false;
+		if (ref < first_ref || ref >= test_txids.size())
+			return false;
+		memcpy(txid, &test_txids[ref][0], 32);
+		return true;
+	};
+
+	size_t tx_bytes = 0, coded_bytes = 0;
+	for (int i = 0; i < 2000; i++) {
+		std::shared_ptr<std::vector<unsigned char> > tx = make_test_tx();
+		std::vector<unsigned char> coded(1, 0xab);
+		if (!encode_tx(tx->begin(), tx->end(), coded, lookup)) {
+			printf("Failed to encode a standard tx\n");
+			exit(14);
+		}
+		coded.erase(coded.begin());
+
+		std::vector<unsigned char> decoded(1, 0xcd);
+		const char* err = decode_tx(coded, decoded, tx->size(), resolve);
+		if (err || decoded.size() != tx->size() + 1 || decoded[0] != 0xcd || !std::equal(tx->begin(), tx->end(), decoded.begin() + 1)) {
+			printf("Decoded tx did not match (%s)\n", err);
+			exit(14);
+		}
+		tx_bytes += tx->size();
+		coded_bytes += coded.size();
+
+		if (decode_tx(coded, decoded, tx->size() - 1, resolve) == NULL || decoded.size() != tx->size() + 1) {
+			printf("Decoded tx larger than max_size\n");
+			exit(14);
+		}
+		if (i % 100 == 0) {
+			for (size_t len = 0; len < coded.size(); len++) {
+				std::vector<unsigned char> truncated(coded.begin(), coded.begin() + len);
+				if (decode_tx(truncated, decoded, tx->size(), resolve) == NULL || decoded.size() != tx->size() + 1) {
+					printf("Decoded a truncated tx\n");
+					exit(14);
+				}
+			}
+		}
+	}
+
+	// A scriptSig length with a non-canonical (3-byte) varint can't be re-created, so it is sent raw
+	std::vector<unsigned char> tx;
+	push_le32(tx, 1);
+	tx.push_back(1);
+	push_random(tx, 36);
+	tx.insert(tx.end(), {0xfd, 25, 0});
+	push_random(tx, 25);
+	push_le32(tx, 0xffffffff);
+	tx.push_back(1);
+	push_random(tx, 8);
+	push_output_script(tx, 0, 0);
+	push_le32(tx, 0);
+	std::vector<unsigned char> coded(3, 0xab);
+	if (encode_tx(tx.begin(), tx.end(), coded, lookup) || coded != std::vector<unsigned char>(3, 0xab)) {
+		printf("Encoded a tx with a non-canonical varint\n");
+		exit(14);
+	}
+
+	printf("Coded 2000 txn from %lu to %lu bytes\n", (unsigned long)tx_bytes, (unsigned long)coded_bytes);
+}
+
+void test_short_ids(bool useTxCoding) {
+	const char* test = useTxCoding ? "short ids (tx coding)" : "short ids";
+	RelayNodeCompressor sender(false, true, useTxCoding);
+	TestRelayClient client(true, useTxCoding);
+
+	for (int round = 0; round < 20; round++) {
+		// Half the rounds use short ids narrow enough that there are collisions in every block
+		short_id_mask = round % 2 ? 0xfff : 0xffffffffffffULL;
+
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > cached;
+		for (int i = 0; i < 300; i++)
+			cached.push_back(relay_test_tx(sender, client));
+		std::shuffle(cached.begin(), cached.end(), engine);
+
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		txn.push_back(make_test_tx());
+		for (int i = 0; i < 250; i++)
+			txn.push_back(engine() % 5 ? cached[i] : make_test_tx());
+		test_block_roundtrip(sender, client, make_test_block(txn), test);
+		test_caches_match(sender, client.compressor, test);
+	}
+	short_id_mask = 0xffffffffffffULL;
+}
+
+void test_tx_coded_block() {
+	const char* test = "tx coded block";
+	RelayNodeCompressor sender(false, true, true);
+	TestRelayClient client(true, true);
+
+	// Txn in full which spend each other and cached txn, so prevouts go as block and short id refs
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+	txn.push_back(make_test_tx());
+	for (int i = 0; i < 100; i++)
+		txn.push_back(relay_test_tx(sender, client));
+	std::shuffle(txn.begin() + 1, txn.end(), engine);
+	txn.resize(50);
+	for (int i = 0; i < 400; i++)
+		txn.push_back(make_test_tx());
+
+	std::vector<unsigned char> block = make_test_block(txn);
+	size_t wire = test_block_roundtrip(sender, client, block, test);
+	test_caches_match(sender, client.compressor, test);
+	printf("Tx coded block of %lu bytes sent in %lu\n", (unsigned long)block.size(), (unsigned long)wire);
+}
+
+void test_runs() {
+	const char* test = "runs";
+	RelayNodeCompressor sender(false, true, true);
+	TestRelayClient client(true, true);
+
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > cached;
+	for (int i = 0; i < 1000; i++)
+		cached.push_back(relay_test_tx(sender, client));
+
+	// A block which follows the cache but for a few gaps goes as a handful of runs
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+	txn.push_back(make_test_tx());
+	for (int i = 100; i < 600; i++)
+		if (i % 97)
+			txn.push_back(cached[i]);
+	size_t wire = test_block_roundtrip(sender, client, make_test_block(txn), test);
+	if (wire > 80 + 1000) {
+		printf("%s: %lu cached txn took %lu bytes\n", test, (unsigned long)txn.size(), (unsigned long)wire);
+		exit(15);
+	}
+	test_caches_match(sender, client.compressor, test);
+
+	// Runs broken up by txn out of order, repeated and not in the cache
+	txn.clear();
+	txn.push_back(make_test_tx());
+	for (int i = 0; i < 100; i++)
+		txn.push_back(cached[i]);
+	std::swap(txn[10], txn[20]);
+	txn.push_back(txn[5]);
+	txn.insert(txn.begin() + 50, make_test_tx());
+	for (int i = 600; i < 900; i++)
+		txn.push_back(cached[i]);
+	test_block_roundtrip(sender, client, make_test_block(txn), test);
+	test_caches_match(sender, client.compressor, test);
+}
+
+// Streams block from sender to client, stopping after abort_after txn (if it is less than the
+// block's tx count) or corrupting its merkle root, either of which has to abort it on both sides
+void test_abort_block(RelayNodeCompressor& sender, TestRelayClient& client, std::vector<unsigned char> block, uint32_t abort_after, const char* test) {
+	if (abort_after == uint32_t(-1))
+		block[sizeof(struct bitcoin_msg_header) + 4 + 32] ^= 1;
+	BlockView view(block);
+
+	std::vector<unsigned char> msg;
+	{
+		BlockCompressionStream stream(sender, false, true);
+		const char* err = stream.start(&block[sizeof(struct bitcoin_msg_header)], view.get_hash(), view.tx_count(), msg);
+		if (err) {
+			printf("%s: failed to start block %s\n", test, err);
+			exit(16);
+		}
+		for (uint32_t i = 0; i < view.tx_count() && i < abort_after; i++)
+			stream.add_tx(block.begin() + view.tx(i).offset, block.begin() + view.tx(i).offset + view.tx(i).length, msg);
+		if (abort_after < view.tx_count())
+			stream.abort(msg);
+		else if (!stream.finish(msg)) {
+			printf("%s: block with a bad merkle root was sent\n", test);
+			exit(16);
+		}
+	}
+
+	uint32_t aborted = client.blocks_aborted;
+	client.apply(msg, test);
+	if (client.blocks_aborted != aborted + 1) {
+		printf("%s: aborted block was not aborted by the receiver\n", test);
+		exit(16);
+	}
+	test_caches_match(sender, client.compressor, test);
+}
+
+void test_abort(bool useTxCoding) {
+	const char* test = useTxCoding ? "abort (tx coding)" : "abort";
+	RelayNodeCompressor sender(false, true, useTxCoding);
+	TestRelayClient client(true, useTxCoding);
+
+	for (int round = 0; round < 6; round++) {
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		txn.push_back(make_test_tx());
+		for (int i = 0; i < 200; i++)
+			txn.push_back(engine() % 4 ? relay_test_tx(sender, client) : make_test_tx());
+		std::vector<unsigned char> block = make_test_block(txn);
+
+		test_abort_block(sender, client, block, round % 2 ? uint32_t(-1) : 1 + engine() % 200, test);
+		// The sender may try the block again (ie once the rest of it arrives)
+		test_block_roundtrip(sender, client, block, test);
+		test_caches_match(sender, client.compressor, test);
+	}
+}
+
+void test_evict() {
+	const char* test = "evict";
+	RelayNodeCompressor sender(false, true, true);
+	TestRelayClient client(true, true);
+
+	// Every tx in the sender's cache with its fee, as the test expects it to be
+	std::vector<std::tuple<std::shared_ptr<std::vector<unsigned char> >, uint64_t, std::vector<unsigned char> > > cached;
+	uint32_t evicted = 0;
+	for (int i = 0; i < 1600; i++) {
+		std::shared_ptr<std::vector<unsigned char> > tx = make_test_tx(3000 + engine() % 2000);
+		uint64_t fee = engine() % 50000;
+		std::shared_ptr<std::vector<unsigned char> > evict_msg;
+		std::shared_ptr<std::vector<unsigned char> > msg = sender.get_relay_transaction(tx, fee, evict_msg);
+		if (!msg) {
+			printf("%s: tx not relayed\n", test);
+			exit(17);
+		}
+		if (evict_msg)
+			client.apply(*evict_msg, test);
+		client.apply(*msg, test);
+
+		// Only ever the lowest fee txn go, and only with an EVICT message
+		uint64_t max_evicted_fee = 0, min_cached_fee = uint64_t(-1);
+		size_t was_cached = cached.size();
+		for (size_t j = 0; j < cached.size(); ) {
+			if (sender.was_tx_sent(&std::get<2>(cached[j])[0])) {
+				min_cached_fee = std::min(min_cached_fee, std::get<1>(cached[j]));
+				j++;
+			} else {
+				max_evicted_fee = std::max(max_evicted_fee, std::get<1>(cached[j]));
+				cached.erase(cached.begin() + j);
+			}
+		}
+		if ((cached.size() != was_cached) != bool(evict_msg) || max_evicted_fee > min_cached_fee) {
+			printf("%s: evicted a tx with fee %lu over one with %lu\n", test, (unsigned long)max_evicted_fee, (unsigned long)min_cached_fee);
+			exit(17);
+		}
+		evicted += was_cached - cached.size();
+		cached.emplace_back(tx, fee, test_txids.back());
+	}
+	if (!evicted) {
+		printf("%s: nothing was evicted\n", test);
+		exit(17);
+	}
+	test_caches_match(sender, client.compressor, test);
+
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+	txn.push_back(make_test_tx());
+	for (size_t i = 0; i < cached.size(); i += 3)
+		txn.push_back(std::get<0>(cached[i]));
+	test_block_roundtrip(sender, client, make_test_block(txn), test);
+	test_caches_match(sender, client.compressor, test);
+	printf("Evicted %u txn by fee\n", evicted);
+}
+
+void test_recent() {
+	const char* test = "recent";
+	RelayNodeCompressor sender(false, true, true);
+	TestRelayClient client(true, true);
+
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > cached;
+	for (int i = 0; i < 500; i++) {
+		std::shared_ptr<std::vector<unsigned char> > tx = make_test_tx(), evict_msg;
+		client.apply(*sender.get_relay_transaction(tx, i, evict_msg), test);
+		cached.push_back(tx);
+	}
+
+	// Block b competes with a, sharing most of its txn, which are now only in the recent cache
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > a(cached.begin(), cached.begin() + 300), b(cached.begin() + 50, cached.begin() + 350);
+	std::reverse(b.begin(), b.end());
+	a.insert(a.begin(), make_test_tx());
+	b.insert(b.begin(), make_test_tx());
+	test_block_roundtrip(sender, client, make_test_block(a), test);
+	test_caches_match(sender, client.compressor, test);
+	std::vector<unsigned char> block_b = make_test_block(b);
+	size_t wire = test_block_roundtrip(sender, client, block_b, test);
+	if (wire > block_b.size() / 10) {
+		printf("%s: competing block took %lu bytes\n", test, (unsigned long)wire);
+		exit(18);
+	}
+	test_caches_match(sender, client.compressor, test);
+
+	// b orphans a, whose txn not in b go back to the mempool and are relayed again
+	for (int i = 0; i < 50; i++) {
+		std::shared_ptr<std::vector<unsigned char> > evict_msg;
+		std::shared_ptr<std::vector<unsigned char> > msg = sender.get_relay_transaction(cached[i], 1000, evict_msg);
+		if (msg->size() != sizeof(struct relay_msg_header) + 2) {
+			printf("%s: recent tx was sent in full\n", test);
+			exit(18);
+		}
+		std::shared_ptr<std::vector<unsigned char> > tx = client.apply(*msg, test);
+		if (!tx || *tx != *cached[i]) {
+			printf("%s: restored the wrong tx\n", test);
+			exit(18);
+		}
+	}
+	test_caches_match(sender, client.compressor, test);
+}
+
+// A compressor with no clients only sees block_mined(), which has to leave it where compressing
+// the block would have, so that its next client is given the same cache as everyone else's
+void test_block_mined(bool useTxCoding) {
+	const char* test = useTxCoding ? "block mined (tx coding)" : "block mined";
+	RelayNodeCompressor sender(false, true, useTxCoding), idle(false, true, useTxCoding);
+	TestRelayClient client(true, useTxCoding);
+
+	for (int round = 0; round < 3; round++) {
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > cached;
+		for (int i = 0; i < 300; i++) {
+			cached.push_back(relay_test_tx(sender, client));
+			idle.get_relay_transaction(cached.back());
+		}
+		std::shuffle(cached.begin(), cached.end(), engine);
+
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		txn.push_back(make_test_tx());
+		for (int i = 0; i < 250; i++)
+			txn.push_back(engine() % 5 ? cached[i] : make_test_tx());
+		std::vector<unsigned char> block = make_test_block(txn);
+		test_block_roundtrip(sender, client, block, test);
+		idle.block_mined(BlockView(block));
+		test_caches_match(idle, client.compressor, test);
+
+		std::vector<unsigned char> hash = BlockView(block).get_hash();
+		if (idle.block_sent(hash)) {
+			printf("%s: block was not marked sent\n", test);
+			exit(20);
+		}
+	}
+}
+
+void test_sessions() {
+	const char* test = "sessions";
+	RelayNodeCompressor sender(false, true, true);
+
+	// Everything which changes the sender's cache, in order, as SessionHistory keeps it
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > history;
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > pool;
+	for (int round = 0; round < 8; round++) {
+		for (int i = 0; i < 250; i++) {
+			std::shared_ptr<std::vector<unsigned char> > tx = round % 3 == 2 && i % 2 ? pool[engine() % pool.size()] : make_test_tx(engine() % 8000);
+			std::shared_ptr<std::vector<unsigned char> > evict_msg;
+			std::shared_ptr<std::vector<unsigned char> > msg = sender.get_relay_transaction(tx, engine() % 1000, evict_msg);
+			if (evict_msg)
+				history.push_back(evict_msg);
+			if (msg)
+				history.push_back(msg);
+			pool.push_back(tx);
+		}
+
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+		txn.push_back(make_test_tx());
+		for (int i = 0; i < 150; i++)
+			txn.push_back(pool[engine() % pool.size()]);
+		std::sort(txn.begin() + 1, txn.end());
+		txn.erase(std::unique(txn.begin() + 1, txn.end()), txn.end());
+		std::vector<unsigned char> block = make_test_block(txn);
+		if (round % 4 == 3) {
+			// Aborted blocks still change the cache, so count as well
+			std::vector<unsigned char> msg;
+			{
+				BlockView view(block);
+				BlockCompressionStream stream(sender, false, true);
+				stream.start(&block[sizeof(struct bitcoin_msg_header)], view.get_hash(), view.tx_count(), msg);
+				for (uint32_t i = 0; i < view.tx_count() / 2; i++)
+					stream.add_tx(block.begin() + view.tx(i).offset, block.begin() + view.tx(i).offset + view.tx(i).length, msg);
+				stream.abort(msg);
+			}
+			history.push_back(std::make_shared<std::vector<unsigned char> >(msg));
+		}
+		history.push_back(compress_test_block(sender, block, test));
+	}
+
+	TestRelayClient client(true, true);
+	for (const std::shared_ptr<std::vector<unsigned char> >& msg : history)
+		client.apply(*msg, test);
+	if (client.session_seq != history.size() || !client.blocks_aborted) {
+		printf("%s: client is at %lu of %lu\n", test, (unsigned long)client.session_seq, (unsigned long)history.size());
+		exit(19);
+	}
+	test_caches_match(sender, client.compressor, test);
+
+	// A client which disconnects anywhere and is sent what it missed from its seq on ends up in sync
+	for (size_t disconnect = 0; disconnect <= history.size(); disconnect += 1 + engine() % (history.size() / 4)) {
+		TestRelayClient resumed(true, true);
+		for (size_t i = 0; i < disconnect; i++)
+			resumed.apply(*history[i], test);
+
+		std::shared_ptr<std::vector<unsigned char> > session_msg = sender.session_to_msg(0x0123456789abcdefULL, resumed.session_seq, true);
+		uint64_t seq = 0;
+		for (int i = 0; i < 8; i++)
+			seq = (seq << 8) | (*session_msg)[sizeof(struct relay_msg_header) + 8 + i];
+		if (seq != disconnect || (*session_msg)[sizeof(struct relay_msg_header) + 16] != 1 || (*session_msg)[sizeof(struct relay_msg_header)] != 0x01) {
+			printf("%s: bad session message\n", test);
+			exit(19);
+		}
+
+		for (size_t i = seq; i < history.size(); i++)
+			resumed.apply(*history[i], test);
+		test_caches_match(sender, resumed.compressor, test);
+	}
+
+	// One which can't be resumed is reset and sent the sender's caches (as relay_node_connected does)
+	TestRelayClient reset(true, true);
+	for (size_t i = 0; i < history.size() / 2; i++)
+		reset.apply(*history[i], test);
+	reset.compressor.reset_recv();
+	sender.for_each_recent_tx([&](const std::shared_ptr<std::vector<unsigned char> >& tx) {
+		reset.apply(*sender.recent_tx_to_msg(tx), test);
+	});
+	sender.for_each_sent_tx([&](const std::shared_ptr<std::vector<unsigned char> >& tx) {
+		reset.apply(*sender.tx_to_msg(tx), test);
+	});
+	test_caches_match(sender, reset.compressor, test);
+
+	// Both keep up with what the sender does next
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn;
+	txn.push_back(make_test_tx());
+	for (int i = 0; i < 100; i++)
+		txn.push_back(pool[pool.size() - 1 - i]);
+	std::vector<unsigned char> block = make_test_block(txn);
+	std::shared_ptr<std::vector<unsigned char> > msg = compress_test_block(sender, block, test);
+	client.apply(*msg, test);
+	reset.apply(*msg, test);
+	test_caches_match(sender, client.compressor, test);
+	test_caches_match(sender, reset.compressor, test);
+}
+
+void run_synthetic_tests() {
+	test_hashmruset();
+	test_remove_batch();
+	test_header_announce();
+	test_tx_coding();
+	test_short_ids(false);
+	test_short_ids(true);
+	test_tx_coded_block();
+	test_runs();
+	test_abort(false);
+	test_abort(true);
+	test_evict();
+	test_recent();
+	test_block_mined(false);
+	test_block_mined(true);
+	test_sessions();
+	printf("Synthetic block tests passed\n");
+}
+
 int main() {
 	std::vector<unsigned char> data(sizeof(struct bitcoin_msg_header));
 	std::vector<unsigned char> lastBlock;
 
 	std::vector<std::shared_ptr<std::vector<unsigned char> > > allTxn;
 
+	run_synthetic_tests();
+
 	FILE* f = fopen("block.txt", "r");
+	if (!f) {
+		printf("No block.txt, skipping tests on real blocks\n");
+		return 0;
+	}
 	while (true) {
 		char hex[2];
 		if (fread(hex, 1, 1, f) != 1)
@@ -242,5 +1143,7 @@ int main() {
 
 	printf("Total time spent compressing %u blocks: %lf ms (avg %lf, min %lf, max %lf)\n", compress_runs, to_millis_double(total_compress_time), to_millis_double(total_compress_time / compress_runs), to_millis_double(min_compress_time), to_millis_double(max_compress_time));
 	printf("Total time spent decompressing %u blocks: %lf ms (avg %lf, min %lf, max %lf)\n", decompress_runs, to_millis_double(total_decompress_time), to_millis_double(total_decompress_time / decompress_runs), to_millis_double(min_decompress_time), to_millis_double(max_decompress_time));
+	global_sender.get_send_stats().print("global sender");
+	global_receiver.get_recv_stats().print("global receiver");
 	return 0;
 }
@@ -0,0 +1,328 @@
+#include "txcoder.h"
+#include "utils.h"
+
+#include <string.h>
+
+// Flags byte at the start of each coded input
+#define IN_PREVOUT_MASK		0x03
+#define IN_SEQUENCE_MASK	0x0c // 0: sequence follows, 1-3: 0xffffffff, 0xfffffffe, 0xfffffffd
+#define IN_SCRIPT_SIG_PUBKEY	0x10 // scriptSig is <sig> <33-byte pubkey>, sent without its pushes
+
+// Output scripts are sent as one varint, less than OUT_SCRIPT_RAW for a template followed by the
+// hash, otherwise OUT_SCRIPT_RAW + script length followed by the script
+enum { OUT_SCRIPT_P2PKH, OUT_SCRIPT_P2SH, OUT_SCRIPT_P2WPKH, OUT_SCRIPT_P2WSH, OUT_SCRIPT_RAW };
+
+/**** Encoding helpers ****/
+static inline void write_packed(std::vector<unsigned char>& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	out.push_back(v);
+}
+
+static inline uint64_t read_packed(std::vector<unsigned char>::const_iterator& it, const std::vector<unsigned char>::const_iterator& end) {
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		move_forward(it, 1, end);
+		v |= uint64_t(*(it-1) & 0x7f) << shift;
+		if (!(*(it-1) & 0x80))
+			return v;
+	}
+	throw read_exception();
+}
+
+static inline void write_compact(std::vector<unsigned char>& out, uint64_t v) {
+	if (v < 0xfd)
+		out.push_back(v);
+	else if (v <= 0xffff) {
+		out.push_back(0xfd);
+		out.push_back(v); out.push_back(v >> 8);
+	} else {
+		out.push_back(0xfe);
+		out.push_back(v); out.push_back(v >> 8); out.push_back(v >> 16); out.push_back(v >> 24);
+	}
+}
+
+// Reads a bitcoin varint, throwing read_exception if it isn't in the shortest form (which we
+// couldn't reproduce) or is too large to be a sane count or script length
+static inline uint64_t read_compact(std::vector<unsigned char>::const_iterator& it, const std::vector<unsigned char>::const_iterator& end) {
+	std::vector<unsigned char>::const_iterator start = it;
+	uint64_t v = read_varint(it, end);
+	if (v > 0xffffffff || size_t(it - start) != (v < 0xfd ? 1 : (v <= 0xffff ? 3 : 5)))
+		throw read_exception();
+	return v;
+}
+
+static inline uint32_t read_le32(const std::vector<unsigned char>::const_iterator& it) {
+	return uint32_t(it[0]) | (uint32_t(it[1]) << 8) | (uint32_t(it[2]) << 16) | (uint32_t(it[3]) << 24);
+}
+
+static inline void write_le32(std::vector<unsigned char>& out, uint32_t v) {
+	out.push_back(v); out.push_back(v >> 8); out.push_back(v >> 16); out.push_back(v >> 24);
+}
+
+static const unsigned char null_txid[32] = {0};
+
+/**** Encoding ****/
+bool encode_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end,
+		std::vector<unsigned char>& out, const tx_prevout_lookup& lookup) {
+	size_t out_start = out.size();
+	try {
+		std::vector<unsigned char>::const_iterator it = begin;
+		move_forward(it, 4, end);
+		write_packed(out, read_le32(begin));
+
+		uint64_t txins = read_compact(it, end);
+		write_packed(out, txins);
+		for (uint64_t i = 0; i < txins; i++) {
+			std::vector<unsigned char>::const_iterator prevout = it;
+			move_forward(it, 36, end);
+			uint32_t prev_index = read_le32(prevout + 32);
+
+			uint64_t script_len = read_compact(it, end);
+			std::vector<unsigned char>::const_iterator script = it;
+			move_forward(it, script_len + 4, end);
+			uint32_t sequence = read_le32(it - 4);
+
+			uint64_t ref = 0;
+			unsigned char flags;
+			if (prev_index == 0xffffffff && !memcmp(&(*prevout), null_txid, 32))
+				flags = TX_PREVOUT_NULL;
+			else
+				flags = lookup(&(*prevout), ref);
+
+			if (sequence == 0xffffffff)
+				flags |= 1 << 2;
+			else if (sequence == 0xfffffffe)
+				flags |= 2 << 2;
+			else if (sequence == 0xfffffffd)
+				flags |= 3 << 2;
+
+			uint8_t sig_len = script_len ? script[0] : 0;
+			bool sig_pubkey = sig_len >= 1 && sig_len <= 75 && script_len == 1u + sig_len + 1 + 33 && script[1 + sig_len] == 33;
+			if (sig_pubkey)
+				flags |= IN_SCRIPT_SIG_PUBKEY;
+			out.push_back(flags);
+
+			switch (flags & IN_PREVOUT_MASK) {
+			case TX_PREVOUT_TXID:
+				out.insert(out.end(), prevout, prevout + 32);
+				break;
+			case TX_PREVOUT_BLOCK_TX:
+				write_packed(out, ref);
+				break;
+			case TX_PREVOUT_SHORT_ID:
+				for (int j = 5; j >= 0; j--)
+					out.push_back((ref >> (8 * j)) & 0xff);
+				break;
+			}
+			if ((flags & IN_PREVOUT_MASK) != TX_PREVOUT_NULL)
+				write_packed(out, prev_index);
+
+			if (sig_pubkey) {
+				out.insert(out.end(), script, script + 1 + sig_len);
+				out.insert(out.end(), script + 2 + sig_len, script + script_len);
+			} else {
+				write_packed(out, script_len);
+				out.insert(out.end(), script, script + script_len);
+			}
+
+			if (!(flags & IN_SEQUENCE_MASK))
+				write_le32(out, sequence);
+		}
+
+		uint64_t txouts = read_compact(it, end);
+		write_packed(out, txouts);
+		for (uint64_t i = 0; i < txouts; i++) {
+			move_forward(it, 8, end);
+			uint64_t value = read_le32(it - 8) | (uint64_t(read_le32(it - 4)) << 32);
+			write_packed(out, value);
+
+			uint64_t script_len = read_compact(it, end);
+			std::vector<unsigned char>::const_iterator s = it;
+			move_forward(it, script_len, end);
+
+			if (script_len == 25 && s[0] == 0x76 && s[1] == 0xa9 && s[2] == 0x14 && s[23] == 0x88 && s[24] == 0xac) {
+				write_packed(out, OUT_SCRIPT_P2PKH);
+				out.insert(out.end(), s + 3, s + 23);
+			} else if (script_len == 23 && s[0] == 0xa9 && s[1] == 0x14 && s[22] == 0x87) {
+				write_packed(out, OUT_SCRIPT_P2SH);
+				out.insert(out.end(), s + 2, s + 22);
+			} else if (script_len == 22 && s[0] == 0x00 && s[1] == 0x14) {
+				write_packed(out, OUT_SCRIPT_P2WPKH);
+				out.insert(out.end(), s + 2, s + 22);
+			} else if (script_len == 34 && s[0] == 0x00 && s[1] == 0x20) {
+				write_packed(out, OUT_SCRIPT_P2WSH);
+				out.insert(out.end(), s + 2, s + 34);
+			} else {
+				write_packed(out, OUT_SCRIPT_RAW + script_len);
+				out.insert(out.end(), s, s + script_len);
+			}
+		}
+
+		move_forward(it, 4, end);
+		write_packed(out, read_le32(it - 4));
+
+		if (it != end)
+			throw read_exception();
+	} catch (read_exception) {
+		out.resize(out_start);
+		return false;
+	}
+	return true;
+}
+
+/**** Decoding ****/
+static const char* decode_tx_into(const std::vector<unsigned char>& coded, std::vector<unsigned char>& out, size_t out_start, size_t max_size, const tx_prevout_resolve& resolve) {
+	try {
+		std::vector<unsigned char>::const_iterator it = coded.begin(), end = coded.end();
+
+		uint64_t version = read_packed(it, end);
+		if (version > 0xffffffff)
+			return "got a coded tx with a bad version";
+		write_le32(out, version);
+
+		uint64_t txins = read_packed(it, end);
+		if (txins > 0xffffffff)
+			return "got a coded tx with too many inputs";
+		write_compact(out, txins);
+		for (uint64_t i = 0; i < txins; i++) {
+			move_forward(it, 1, end);
+			unsigned char flags = *(it-1);
+			if (flags & ~(IN_PREVOUT_MASK | IN_SEQUENCE_MASK | IN_SCRIPT_SIG_PUBKEY))
+				return "got a coded tx with unknown input flags";
+
+			int kind = flags & IN_PREVOUT_MASK;
+			if (kind == TX_PREVOUT_TXID) {
+				std::vector<unsigned char>::const_iterator txid = it;
+				move_forward(it, 32, end);
+				out.insert(out.end(), txid, it);
+			} else if (kind == TX_PREVOUT_NULL) {
+				out.insert(out.end(), null_txid, null_txid + 32);
+				write_le32(out, 0xffffffff);
+			} else {
+				uint64_t ref = 0;
+				if (kind == TX_PREVOUT_BLOCK_TX)
+					ref = read_packed(it, end);
+				else {
+					move_forward(it, 6, end);
+					for (int j = 6; j > 0; j--)
+						ref = (ref << 8) | *(it-j);
+				}
+				size_t txid_pos = out.size();
+				out.resize(txid_pos + 32);
+				if (!resolve(kind, ref, &out[txid_pos]))
+					return "failed to find referenced prevout";
+			}
+			if (kind != TX_PREVOUT_NULL) {
+				uint64_t prev_index = read_packed(it, end);
+				if (prev_index > 0xffffffff)
+					return "got a coded tx with a bad prevout index";
+				write_le32(out, prev_index);
+			}
+
+			if (flags & IN_SCRIPT_SIG_PUBKEY) {
+				move_forward(it, 1, end);
+				uint8_t sig_len = *(it-1);
+				if (sig_len < 1 || sig_len > 75)
+					return "got a coded tx with a bad signature length";
+				std::vector<unsigned char>::const_iterator sig = it;
+				move_forward(it, sig_len + 33, end);
+				out.push_back(1 + sig_len + 1 + 33);
+				out.push_back(sig_len);
+				out.insert(out.end(), sig, sig + sig_len);
+				out.push_back(33);
+				out.insert(out.end(), sig + sig_len, it);
+			} else {
+				uint64_t script_len = read_packed(it, end);
+				if (script_len > max_size)
+					return "got unreasonably large tx";
+				std::vector<unsigned char>::const_iterator script = it;
+				move_forward(it, script_len, end);
+				write_compact(out, script_len);
+				out.insert(out.end(), script, it);
+			}
+
+			switch ((flags & IN_SEQUENCE_MASK) >> 2) {
+			case 0:
+				move_forward(it, 4, end);
+				out.insert(out.end(), it - 4, it);
+				break;
+			case 1: write_le32(out, 0xffffffff); break;
+			case 2: write_le32(out, 0xfffffffe); break;
+			case 3: write_le32(out, 0xfffffffd); break;
+			}
+
+			if (out.size() - out_start > max_size)
+				return "got unreasonably large tx";
+		}
+
+		uint64_t txouts = read_packed(it, end);
+		if (txouts > 0xffffffff)
+			return "got a coded tx with too many outputs";
+		write_compact(out, txouts);
+		for (uint64_t i = 0; i < txouts; i++) {
+			uint64_t value = read_packed(it, end);
+			write_le32(out, value);
+			write_le32(out, value >> 32);
+
+			uint64_t script_type = read_packed(it, end);
+			std::vector<unsigned char>::const_iterator hash = it;
+			switch (script_type) {
+			case OUT_SCRIPT_P2PKH:
+				move_forward(it, 20, end);
+				out.insert(out.end(), {25, 0x76, 0xa9, 0x14});
+				out.insert(out.end(), hash, it);
+				out.insert(out.end(), {0x88, 0xac});
+				break;
+			case OUT_SCRIPT_P2SH:
+				move_forward(it, 20, end);
+				out.insert(out.end(), {23, 0xa9, 0x14});
+				out.insert(out.end(), hash, it);
+				out.push_back(0x87);
+				break;
+			case OUT_SCRIPT_P2WPKH:
+				move_forward(it, 20, end);
+				out.insert(out.end(), {22, 0x00, 0x14});
+				out.insert(out.end(), hash, it);
+				break;
+			case OUT_SCRIPT_P2WSH:
+				move_forward(it, 32, end);
+				out.insert(out.end(), {34, 0x00, 0x20});
+				out.insert(out.end(), hash, it);
+				break;
+			default:
+				if (script_type - OUT_SCRIPT_RAW > max_size)
+					return "got unreasonably large tx";
+				move_forward(it, script_type - OUT_SCRIPT_RAW, end);
+				write_compact(out, script_type - OUT_SCRIPT_RAW);
+				out.insert(out.end(), hash, it);
+			}
+
+			if (out.size() - out_start > max_size)
+				return "got unreasonably large tx";
+		}
+
+		uint64_t locktime = read_packed(it, end);
+		if (locktime > 0xffffffff)
+			return "got a coded tx with a bad locktime";
+		write_le32(out, locktime);
+
+		if (it != end)
+			return "got a coded tx with trailing data";
+		if (out.size() - out_start > max_size)
+			return "got unreasonably large tx";
+	} catch (read_exception) {
+		return "got a truncated coded tx";
+	}
+	return NULL;
+}
+
+const char* decode_tx(const std::vector<unsigned char>& coded, std::vector<unsigned char>& out, size_t max_size, const tx_prevout_resolve& resolve) {
+	size_t out_start = out.size();
+	const char* err = decode_tx_into(coded, out, out_start, max_size, resolve);
+	if (err)
+		out.resize(out_start);
+	return err;
+}
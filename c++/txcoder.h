@@ -0,0 +1,39 @@
+#ifndef _RELAY_TXCODER_H
+#define _RELAY_TXCODER_H
+
+#include <vector>
+#include <cstddef>
+#include <functional>
+#include <stdint.h>
+
+/*************************************
+ **** Transaction template coding ****
+ *************************************/
+// A lossless, more compact encoding for transactions which have to be sent in full.
+// Standard output scripts (P2PKH, P2SH, P2WPKH, P2WSH) are sent as just their hash, a
+// <sig> <compressed pubkey> scriptSig loses its push opcodes, version, locktime, values and indexes
+// are varints and the usual sequence numbers are folded into a flags byte.
+// Prevouts spending a tx the other side already has are sent as a reference to it, not the txid.
+
+enum TxPrevoutKind {
+	TX_PREVOUT_TXID = 0,		// the full 32-byte txid follows
+	TX_PREVOUT_BLOCK_TX = 1,	// ref is the index of an earlier tx in the same block
+	TX_PREVOUT_SHORT_ID = 2,	// ref is the 6-byte short id of a cached tx
+	TX_PREVOUT_NULL = 3,		// coinbase input (zero txid, index 0xffffffff)
+};
+
+// Returns TX_PREVOUT_BLOCK_TX or TX_PREVOUT_SHORT_ID, filling in ref, if the other side can find
+// txid by reference, otherwise TX_PREVOUT_TXID
+typedef std::function<int (const unsigned char* txid, uint64_t& ref)> tx_prevout_lookup;
+// Fills in txid for a reference made by the other side's lookup, returns false if it is unknown
+typedef std::function<bool (int kind, uint64_t ref, unsigned char* txid)> tx_prevout_resolve;
+
+// Appends the coded tx to out and returns true, or returns false with out unchanged if the tx can't
+// be coded losslessly (eg it uses non-canonical varints), in which case it has to be sent as-is
+bool encode_tx(const std::vector<unsigned char>::const_iterator& begin, const std::vector<unsigned char>::const_iterator& end,
+		std::vector<unsigned char>& out, const tx_prevout_lookup& lookup);
+// Appends the decoded tx (at most max_size bytes) to out and returns NULL, or returns a short error
+// with out unchanged
+const char* decode_tx(const std::vector<unsigned char>& coded, std::vector<unsigned char>& out, size_t max_size, const tx_prevout_resolve& resolve);
+
+#endif
@@ -170,7 +170,7 @@ bool lookup_address(const char* addr, struct sockaddr_in6* res) {
 	return true;
 }
 
-void prepare_message(const char* command, unsigned char* headerAndData, size_t datalen) {
+void prepare_message(const char* command, unsigned char* headerAndData, size_t datalen, const unsigned char* checksum) {
 	struct bitcoin_msg_header *header = (struct bitcoin_msg_header*)headerAndData;
 
 	memset(header->command, 0, sizeof(header->command));
@@ -179,9 +179,13 @@ void prepare_message(const char* command, unsigned char* headerAndData, size_t d
 	header->length = htole32(datalen);
 	header->magic = BITCOIN_MAGIC;
 
-	unsigned char fullhash[32];
-	double_sha256(headerAndData + sizeof(struct bitcoin_msg_header), fullhash, datalen);
-	memcpy(header->checksum, fullhash, sizeof(header->checksum));
+	if (checksum)
+		memcpy(header->checksum, checksum, sizeof(header->checksum));
+	else {
+		unsigned char fullhash[32];
+		double_sha256(headerAndData + sizeof(struct bitcoin_msg_header), fullhash, datalen);
+		memcpy(header->checksum, fullhash, sizeof(header->checksum));
+	}
 }
 
 #ifndef WIN32
@@ -425,6 +429,36 @@ void getblockhash(std::vector<unsigned char>& hashRes, const std::vector<unsigne
 	return double_sha256(&block[offset], &hashRes[0], 80);
 }
 
+bool check_header_work(const unsigned char* header, const std::vector<unsigned char>& hash) {
+	assert(hash.size() == 32);
+	if (hash[31] != 0 || hash[30] != 0 || hash[29] != 0 || hash[28] != 0 || hash[27] != 0 || hash[26] != 0 || hash[25] != 0)
+		return false;
+
+	// nBits is a compact mantissa * 256^(exponent - 3), we expand it to little-endian bytes like hash
+	uint32_t bits = header[72] | (header[73] << 8) | (header[74] << 16) | (uint32_t(header[75]) << 24);
+	int exponent = bits >> 24;
+	uint32_t mantissa = bits & 0x007fffff;
+	if ((bits & 0x00800000) || !mantissa)
+		return false;
+
+	unsigned char target[32];
+	memset(target, 0, sizeof(target));
+	for (int i = 0; i < 3; i++) {
+		unsigned char byte = (mantissa >> (8 * i)) & 0xff;
+		int pos = exponent - 3 + i;
+		if (pos >= 32 && byte)
+			return false;
+		if (pos >= 0 && pos < 32)
+			target[pos] = byte;
+	}
+
+	for (int i = 31; i >= 0; i--) {
+		if (hash[i] != target[i])
+			return hash[i] < target[i];
+	}
+	return true;
+}
+
 class not_hex : public std::exception {};
 static inline unsigned char h2c(char c) {
 	if (c >= '0' && c <= '9') return c - '0';
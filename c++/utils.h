@@ -61,7 +61,7 @@ struct relay_msg_header {
 };
 
 #define RELAY_MAGIC_BYTES htonl(0xF2BEEF42)
-#define VERSION_STRING "spammy memeater"
+#define VERSION_STRING "salty templates"
 #define MAX_RELAY_TRANSACTION_BYTES 100000
 #define MAX_FAS_TOTAL_SIZE 5000000
 
@@ -73,6 +73,15 @@ struct relay_msg_header {
 // Limit outbound to avg 2Mbps worst-case (2Mb / 1000 ms)
 #define OUTBOUND_THROTTLE_BYTES_PER_MS 250
 
+// The mempool server sends the relay server each tx it picks as a 32-byte hash followed by the
+// tx's fee per kB (8 bytes, big-endian), which the relay server uses to decide what to evict
+#define MEMPOOL_TX_RECORD_BYTES 40
+// Sent by the mempool server ahead of any records, and checked by the relay server, so that the two
+// refuse to talk rather than misread each other's records. The last byte is the link version, bump
+// it whenever the record layout changes (version 1 was bare 32-byte hashes, with no hello).
+#define MEMPOOL_LINK_HELLO_BYTES 8
+static const unsigned char MEMPOOL_LINK_HELLO[MEMPOOL_LINK_HELLO_BYTES] = {'R', 'N', 'M', 'E', 'M', 'P', 'L', 2};
+
 
 
 #define BITCOIN_MAGIC htonl(0xf9beb4d9)
@@ -126,7 +135,7 @@ static_assert(sizeof(struct bitcoin_version_start) == 4 + 8 + 8 + 26 + 26 + 8 +
  ***************************/
 class read_exception : std::exception {};
 inline void move_forward(std::vector<unsigned char>::const_iterator& it, size_t i, const std::vector<unsigned char>::const_iterator& end) {
-	if (unlikely(it > end-i))
+	if (unlikely(size_t(end - it) < i))
 		throw read_exception();
 	std::advance(it, i);
 }
@@ -141,7 +150,7 @@ ssize_t send_all(int filedes, const char *buf, size_t nbyte);
 std::string gethostname(struct sockaddr_in6 *addr);
 bool lookup_address(const char* addr, struct sockaddr_in6* res);
 bool lookup_cname(const char* host, std::string& cname);
-void prepare_message(const char* command, unsigned char* headerAndData, size_t datalen);
+void prepare_message(const char* command, unsigned char* headerAndData, size_t datalen, const unsigned char* checksum=NULL);
 int create_connect_socket(const std::string& serverHost, const uint16_t serverPort, std::string& error);
 
 /*********************
@@ -150,6 +159,9 @@ int create_connect_socket(const std::string& serverHost, const uint16_t serverPo
 void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte_count);
 void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char* input2, unsigned char* res);
 void getblockhash(std::vector<unsigned char>& hashRes, const std::vector<unsigned char>& block, size_t offset);
+// True if hash (of the 80-byte header) meets both the target in the header's nBits and the minimum
+// difficulty we require of any block before passing it on
+bool check_header_work(const unsigned char* header, const std::vector<unsigned char>& hash);
 
 void double_sha256_init(uint32_t state[8]);
 void double_sha256_step(const unsigned char* input, uint64_t byte_count, uint32_t state[8]);
@@ -196,37 +208,4 @@ void do_assert(bool flag, const char* file, unsigned long line);
 			ms); \
 	} while(0)
 
-/****************************************************************
- *** A mutex that gives acess to the count of waiting threads ***
- ****************************************************************/
-class WaitCountMutex {
-private:
-	std::mutex mutex;
-	std::atomic_int waitCount;
-
-	friend class WaitCountHint;
-public:
-	WaitCountMutex() { waitCount = 0; }
-	void lock() {
-		if (unlikely(!mutex.try_lock())) {
-			waitCount.fetch_add(1, std::memory_order_release);
-			mutex.lock();
-			waitCount.fetch_sub(1, std::memory_order_relaxed);
-		}
-	}
-	bool try_lock() { return mutex.try_lock(); }
-	void unlock() { return mutex.unlock(); }
-	int wait_count() { return waitCount.load(std::memory_order_acquire); }
-};
-
-class WaitCountHint {
-private:
-	WaitCountMutex* mutex;
-public:
-	WaitCountHint(WaitCountMutex& mutexIn)
-		: mutex(&mutexIn)
-		{ mutex->waitCount.fetch_add(1, std::memory_order_release); }
-	~WaitCountHint() { mutex->waitCount.fetch_sub(1, std::memory_order_relaxed); }
-};
-
 #endif